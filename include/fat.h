@@ -46,6 +46,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include "fatcachestats.h"
 
 #if defined(__gamecube__) || defined (__wii__)
 #  include <ogc/disc_io.h>
@@ -90,6 +91,18 @@ This will not startup the disc, so you need to call interface->startup(); first.
 */
 extern bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage);
 
+/*
+As fatMount, but with explicit settings for the separate cache pool that holds FAT and
+directory sectors. cacheSize and SectorsPerPage then only apply to file data.
+metaCacheSize is the number of pages in the metadata pool. If it is 0, FAT and directory
+sectors share the file data cache.
+fatMount uses a metadata pool size suited to the host system.
+freeClusterMap chooses whether to keep the map of free clusters described at
+fatSetFreeClusterMap. If it is false, the map isn't built, not even while mounting.
+*/
+extern bool fatMountWithMetaCache (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage,
+	uint32_t metaCacheSize, uint32_t metaSectorsPerPage, bool freeClusterMap);
+
 /*
 Unmount the partition specified by name.
 If there are open files, it will attempt to synchronise them to disc.
@@ -101,6 +114,106 @@ Get Volume Label
 */
 extern void fatGetVolumeLabel (const char* name, char *label);
 
+/*
+Choose how the cache of the partition specified by name writes dirty sectors back to disc.
+If coalesce is true, dirty sectors are written in ascending order and physically adjacent
+runs are merged into single writes of up to maxTransferSectors sectors (0 = cache size).
+Otherwise each cache page is written back on its own.
+*/
+extern bool fatSetCacheFlushMode (const char* name, bool coalesce, uint32_t maxTransferSectors);
+
+/*
+Return the number of disc writes saved so far by coalescing cache write back.
+*/
+extern uint32_t fatGetCacheFlushSavings (const char* name);
+
+/*
+Configure read-ahead for the partition specified by name, normally straight after mounting it.
+Sequential file reads and directory scans prefetch up to windowPages cache pages ahead,
+with at most maxInFlightPages prefetched pages waiting unused in the cache at once.
+Both are capped at half the cache size. Passing 0 disables read-ahead.
+*/
+extern bool fatSetReadAhead (const char* name, uint32_t windowPages, uint32_t maxInFlightPages);
+
+/*
+Change the number of pages and sectors per page of the file data cache of the partition
+specified by name. Dirty sectors are written back first and open files stay usable.
+The flush mode and read-ahead settings are kept. On failure the old cache stays in place.
+*/
+extern bool fatSetCacheGeometry (const char* name, uint32_t cacheSize, uint32_t SectorsPerPage);
+
+/*
+Start a background thread that writes back dirty cache pages of the partition specified
+by name once they have been dirty for maxAgeMs milliseconds, or once more than dirtyRatio
+percent of a cache's pages are dirty. Writes go out sorted by sector with adjacent runs merged.
+Passing 0 for a limit disables it, and 0 for both stops the thread.
+Only available on the Linux host build, returns false elsewhere.
+*/
+extern bool fatSetWriteback (const char* name, uint32_t maxAgeMs, uint32_t dirtyRatio);
+
+/*
+Enable or disable the in-memory map of free clusters of the partition specified by name.
+The map takes one bit per cluster and lets new clusters be found without reading through
+the FAT. It is on by default except on the NDS and GBA, and is built the first time it is
+needed, which may be while mounting. fatMountWithMetaCache can keep it off from the start. Enabling builds it at once and returns false if there isn't enough memory.
+*/
+extern bool fatSetFreeClusterMap (const char* name, bool enable);
+
+/*
+Return the number of bytes held by the free cluster map of the partition specified by name,
+or 0 if it isn't built.
+*/
+extern uint32_t fatGetFreeClusterMapSize (const char* name);
+
+/*
+Linux host only: return a disc interface over the disc image file or block device at path,
+for passing to fatMount. The image is opened when the interface is started and closed, after
+an fsync, when it is shut down. Transfers are queued through io_uring, up to queueDepth
+at once (0 for the default), when the kernel supports it, and otherwise use blocking
+preadv/pwritev. Only one image can be in use at a time; NULL is returned while one is open.
+*/
+#define FAT_IMAGE_READONLY		0x01	// Open the image read only
+#define FAT_IMAGE_DIRECT		0x02	// Bypass the host page cache with O_DIRECT where alignment allows
+#define FAT_IMAGE_NO_URING		0x04	// Always use blocking preadv/pwritev
+#define FAT_IMAGE_SYNC_WRITES	0x08	// fatMappedImageDisc: msync every write before it returns
+extern const DISC_INTERFACE* fatImageDisc (const char* path, uint32_t flags, uint32_t queueDepth);
+
+/*
+Linux host only: like fatImageDisc, but the image is memory mapped. Reads of sectors that
+aren't held dirty in the cache are served straight from the mapping, without cache pages.
+Writes go into the mapping and reach the image when the disc's clearStatus or shutdown
+calls msync, or on every write with FAT_IMAGE_SYNC_WRITES.
+Takes FAT_IMAGE_READONLY and FAT_IMAGE_SYNC_WRITES.
+*/
+extern const DISC_INTERFACE* fatMappedImageDisc (const char* path, uint32_t flags);
+
+/*
+Get the number of prefetched pages that were used (hits) and that were evicted unused (wasted).
+*/
+extern bool fatGetReadAheadStats (const char* name, uint32_t* hits, uint32_t* wasted);
+
+/*
+Get the cache statistics of the partition specified by name, counted since it was
+mounted or since the last call to fatResetCacheStats.
+*/
+extern bool fatGetCacheStats (const char* name, FAT_CACHE_STATS* stats);
+
+/*
+Zero the cache statistics of the partition specified by name.
+*/
+extern bool fatResetCacheStats (const char* name);
+
+/*
+Reserve clusters for an open file, like posix_fallocate, so that it can grow to length bytes
+without allocating. fd is the file struct libfat's open_r was given. The file size doesn't
+change and nothing is zero filled: the clusters are linked on to the end of the file and only
+become part of it as writes reach them. Any left unused are freed when the file is closed.
+With FAT_PREALLOC_CONTIGUOUS from fatcachestats.h, the new clusters must form a single run.
+Returns 0 on success, or an errno value: ENOSPC if there isn't room, in which case nothing
+is reserved, EBADF if the file isn't open for writing or EINVAL for unknown flags.
+*/
+extern int fatPreallocate (void* fd, uint32_t length, uint32_t flags);
+
 // File attributes
 #define ATTR_ARCHIVE	0x20			// Archive
 #define ATTR_DIRECTORY	0x10			// Directory
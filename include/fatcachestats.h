@@ -0,0 +1,64 @@
+/*
+	fatcachestats.h
+	Cache usage counters returned by fatGetCacheStats and fatPreallocate flags.
+	Kept apart from fat.h so libfat's own sources can use them.
+
+ Copyright (c) 2026 libfat contributors
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef _LIBFAT_CACHESTATS_H
+#define _LIBFAT_CACHESTATS_H
+
+#include <stdint.h>
+
+/*
+Cache usage counters, added up over the file data and FAT/directory cache pools.
+They stay at 0 if libfat was built with NO_CACHE_STATS, except flushCallsSaved,
+readAheadHits and readAheadWasted, which are always counted and are not zeroed by
+fatResetCacheStats, as they also back fatGetCacheFlushSavings and fatGetReadAheadStats.
+*/
+typedef struct {
+	uint32_t hits;					// Page lookups that found the page cached, including by read-ahead
+	uint32_t misses;				// Page lookups that needed a new page, including by read-ahead
+	uint32_t evictions;				// Pages replaced to make room for another
+	uint32_t dirtyWritebacks;		// Dirty pages written back, on eviction or flush
+	uint32_t sectorsRead;			// Sectors read from the disc
+	uint32_t sectorsWritten;		// Sectors written to the disc
+	uint32_t partialReads;			// Reads of part of a sector
+	uint32_t partialWrites;			// Writes of part of a sector
+	uint32_t fullSectorReads;		// Whole sectors read through the cache
+	uint32_t fullSectorWrites;		// Whole sectors written through the cache
+	uint64_t bytesCopied;			// Bytes copied between callers, pages and the staging buffer
+	uint32_t flushCallsSaved;		// Disc writes avoided by coalescing
+	uint32_t readAheadHits;			// Prefetched pages that were later used
+	uint32_t readAheadWasted;		// Prefetched pages evicted without being used
+	uint32_t backgroundWritebacks;	// Dirty pages written back by the background writeback thread
+	uint32_t queuedTransfers;		// Reads and writes queued on a disc with FEATURE_MEDIUM_ASYNC
+	uint32_t mappedSectors;			// Sectors read in place from a disc with FEATURE_MEDIUM_MAPPED
+} FAT_CACHE_STATS;
+
+// fatPreallocate flags
+#define FAT_PREALLOC_CONTIGUOUS	0x01	// Fail rather than reserve a fragmented run
+
+#endif // _LIBFAT_CACHESTATS_H
@@ -9,6 +9,11 @@
  This also has the benefit of throwing out old sectors, so as not to keep
  too many stale pages around.
 
+ Alternatively it can use 2Q, where pages start out in a small FIFO queue
+ and only move to the LRU queue if they are needed again after being
+ pushed out of it. A long sequential read then only cycles through the
+ FIFO, leaving FAT and directory pages in place.
+
  Copyright (c) 2006 Michael "Chishm" Chisholm
 
  Redistribution and use in source and binary forms, with or without modification,
@@ -34,7 +39,12 @@
 */
 
 #include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
+#ifdef USE_WRITEBACK_THREAD
+#include <time.h>
+#endif
 
 #include "common.h"
 #include "cache.h"
@@ -45,11 +55,24 @@
 #include "file_allocation_table.h"
 
 #define CACHE_FREE UINT_MAX
+#define HASH_END   UINT_MAX
+
+static bool _FAT_cache_asyncDrain (CACHE* cache);
 
-CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsPerPage, const DISC_INTERFACE* discInterface, sec_t endOfPartition, unsigned int bytesPerSector) {
+CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsPerPage, const DISC_INTERFACE* discInterface, sec_t endOfPartition, unsigned int bytesPerSector, CACHE_POLICY policy) {
 	CACHE* cache;
 	unsigned int i;
-	CACHE_ENTRY* cacheEntries;
+	CACHE_ENTRY* cacheEntries = NULL;
+	unsigned int* hashBuckets = NULL;
+	unsigned int hashBits;
+	uint32_t* sectorBitmaps = NULL;
+	uint8_t* pageArena = NULL;
+	size_t pageBytes, arenaSize;
+	sec_t* ghostSectors = NULL;
+	unsigned int* ghostHashNext = NULL;
+	unsigned int* ghostBuckets = NULL;
+	unsigned int ghostSize = 0;
+	unsigned int ghostHashBits = 0;
 
 	if (numberOfPages < 2) {
 		numberOfPages = 2;
@@ -69,12 +92,26 @@ CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsP
 	cache->numberOfPages = numberOfPages;
 	cache->sectorsPerPage = sectorsPerPage;
 	cache->bytesPerSector = bytesPerSector;
-
+	cache->bitmapWords = (sectorsPerPage + 31) / 32;
 
 	cacheEntries = (CACHE_ENTRY*) _FAT_mem_allocate ( sizeof(CACHE_ENTRY) * numberOfPages);
 	if (cacheEntries == NULL) {
-		_FAT_mem_free (cache);
-		return NULL;
+		goto fail;
+	}
+
+	// The dirty and valid bitmaps of all pages share one allocation
+	sectorBitmaps = (uint32_t*) _FAT_mem_allocate (sizeof(uint32_t) * cache->bitmapWords * numberOfPages * 2);
+	if (sectorBitmaps == NULL) {
+		goto fail;
+	}
+	memset (sectorBitmaps, 0, sizeof(uint32_t) * cache->bitmapWords * numberOfPages * 2);
+
+	// So do the page buffers, which keeps them together in memory
+	pageBytes = (size_t)sectorsPerPage * bytesPerSector;
+	arenaSize = pageBytes * numberOfPages;
+	pageArena = (uint8_t*) _FAT_mem_allocateArena (arenaSize);
+	if (pageArena == NULL) {
+		goto fail;
 	}
 
 	for (i = 0; i < numberOfPages; i++) {
@@ -82,94 +119,693 @@ CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsP
 		cacheEntries[i].count = 0;
 		cacheEntries[i].last_access = 0;
 		cacheEntries[i].dirty = false;
-		cacheEntries[i].cache = (uint8_t*) _FAT_mem_align ( sectorsPerPage * bytesPerSector );
+		cacheEntries[i].complete = false;
+		cacheEntries[i].dirtySectors = sectorBitmaps + (i * 2 * cache->bitmapWords);
+		cacheEntries[i].validSectors = cacheEntries[i].dirtySectors + cache->bitmapWords;
+		cacheEntries[i].cache = pageArena + (i * pageBytes);
+		cacheEntries[i].hashNext = HASH_END;
+		cacheEntries[i].prefetched = false;
+		cacheEntries[i].frequent = (policy == CACHE_POLICY_LRU);
+		cacheEntries[i].ioPending = false;
+		cacheEntries[i].dirtySince = 0;
+	}
+
+	// 2Q remembers the pages most recently pushed out of the first-touch queue.
+	// The ring, its hash links and its buckets share one allocation
+	if (policy == CACHE_POLICY_2Q) {
+		ghostSize = (numberOfPages + 1) / 2;
+		ghostHashBits = 1;
+		while ((1u << ghostHashBits) < ghostSize * 2) {
+			ghostHashBits++;
+		}
+		ghostSectors = (sec_t*) _FAT_mem_allocate ((sizeof(sec_t) + sizeof(unsigned int)) * ghostSize + (sizeof(unsigned int) << ghostHashBits));
+		if (ghostSectors == NULL) {
+			goto fail;
+		}
+		ghostHashNext = (unsigned int*) (ghostSectors + ghostSize);
+		ghostBuckets = ghostHashNext + ghostSize;
+		for (i = 0; i < ghostSize; i++) {
+			ghostSectors[i] = CACHE_FREE;
+			ghostHashNext[i] = HASH_END;
+		}
+		for (i = 0; i < (1u << ghostHashBits); i++) {
+			ghostBuckets[i] = HASH_END;
+		}
+	}
+
+	// Use at least twice as many buckets as pages, so chains stay short
+	hashBits = 1;
+	while ((1u << hashBits) < numberOfPages * 2) {
+		hashBits++;
+	}
+
+	hashBuckets = (unsigned int*) _FAT_mem_allocate (sizeof(unsigned int) << hashBits);
+	if (hashBuckets == NULL) {
+		goto fail;
+	}
+
+	for (i = 0; i < (1u << hashBits); i++) {
+		hashBuckets[i] = HASH_END;
 	}
 
 	cache->cacheEntries = cacheEntries;
+	cache->pageArena = pageArena;
+	cache->pageArenaSize = arenaSize;
+	cache->hashBuckets = hashBuckets;
+	cache->hashBits = hashBits;
+	cache->accessCounter = 0;
+
+	// The first-touch queue gets a quarter of the cache, as suggested for 2Q
+	cache->policy = policy;
+	cache->recentPages = 0;
+	cache->recentTarget = (numberOfPages / 4 > 0) ? numberOfPages / 4 : 1;
+	cache->ghostSectors = ghostSectors;
+	cache->ghostHashNext = ghostHashNext;
+	cache->ghostBuckets = ghostBuckets;
+	cache->ghostHashBits = ghostHashBits;
+	cache->ghostSize = ghostSize;
+	cache->ghostNext = 0;
+
+	cache->stagingBuffer = NULL;
+	cache->flushOrder = NULL;
+	cache->flushCallsSaved = 0;
+	_FAT_cache_setFlushMode (cache, CACHE_FLUSH_COALESCED, numberOfPages * sectorsPerPage);
+
+	cache->readAheadPending = 0;
+	cache->readAheadHits = 0;
+	cache->readAheadWasted = 0;
+	cache->async = _FAT_disc_async (discInterface);
+	cache->asyncPending = false;
+	cache->asyncFailed = false;
+	cache->stagingBusy = false;
+	cache->mapped = _FAT_disc_mapped (discInterface);
+	cache->generation = 0;
+	_FAT_cache_resetStats (cache);
+	_FAT_cache_setReadAhead (cache, DEFAULT_READAHEAD_PAGES, DEFAULT_READAHEAD_PAGES);
 
 	return cache;
+
+fail:
+	// Undo whatever was allocated before running out of memory
+	if (ghostSectors) {
+		_FAT_mem_free (ghostSectors);
+	}
+	if (pageArena) {
+		_FAT_mem_freeArena (pageArena, arenaSize);
+	}
+	if (sectorBitmaps) {
+		_FAT_mem_free (sectorBitmaps);
+	}
+	if (cacheEntries) {
+		_FAT_mem_free (cacheEntries);
+	}
+	_FAT_mem_free (cache);
+	return NULL;
 }
 
 void _FAT_cache_destructor (CACHE* cache) {
-	unsigned int i;
 	// Clear out cache before destroying it
 	_FAT_cache_flush(cache);
+	_FAT_cache_asyncDrain(cache);
 
 	// Free memory in reverse allocation order
-	for (i = 0; i < cache->numberOfPages; i++) {
-		_FAT_mem_free (cache->cacheEntries[i].cache);
+	if (cache->flushOrder) {
+		_FAT_mem_free (cache->flushOrder);
+	}
+	if (cache->stagingBuffer) {
+		_FAT_mem_free (cache->stagingBuffer);
 	}
+	_FAT_mem_free (cache->hashBuckets);
+	if (cache->ghostSectors) {
+		_FAT_mem_free (cache->ghostSectors);
+	}
+	_FAT_mem_freeArena (cache->pageArena, cache->pageArenaSize);
+	_FAT_mem_free (cache->cacheEntries[0].dirtySectors);
 	_FAT_mem_free (cache->cacheEntries);
 	_FAT_mem_free (cache);
 }
 
 
-static u32 accessCounter = 0;
+/*
+Replace cache with a new one of a different shape on the same disc.
+Dirty sectors are written back first, and the flush mode, read-ahead
+limits and statistics carry over. If the flush or the new allocation
+fails, NULL is returned and the old cache is left untouched.
+*/
+CACHE* _FAT_cache_resize (CACHE* cache, unsigned int numberOfPages, unsigned int sectorsPerPage) {
+	CACHE* newCache;
+	sec_t maxTransfer;
 
-static u32 accessTime(){
-	accessCounter++;
-	return accessCounter;
+	if (!_FAT_cache_flush (cache)) {
+		return NULL;
+	}
+
+	newCache = _FAT_cache_constructor (numberOfPages, sectorsPerPage, cache->disc, cache->endOfPartition, cache->bytesPerSector, cache->policy);
+	if (newCache == NULL) {
+		return NULL;
+	}
+
+	// A transfer limit that defaulted to the whole cache follows the new size
+	maxTransfer = cache->maxTransfer;
+	if (maxTransfer == cache->numberOfPages * cache->sectorsPerPage) {
+		maxTransfer = 0;
+	}
+	_FAT_cache_setFlushMode (newCache, cache->flushMode, maxTransfer);
+	_FAT_cache_setReadAhead (newCache, cache->readAheadWindow, cache->readAheadInFlight);
+	newCache->stats = cache->stats;
+	newCache->flushCallsSaved = cache->flushCallsSaved;
+	newCache->readAheadHits = cache->readAheadHits;
+	newCache->readAheadWasted = cache->readAheadWasted;
+
+	_FAT_cache_destructor (cache);
+	return newCache;
 }
 
+/*
+Each cache keeps its own 64 bit access clock, so mounts don't disturb each
+other's replacement order and the clock never wraps in practice. It is only
+touched under the owning partition's lock.
+*/
+static inline uint64_t accessTime(CACHE* cache){
+	return ++cache->accessCounter;
+}
 
-static CACHE_ENTRY* _FAT_cache_getPage(CACHE *cache,sec_t sector)
-{
-	unsigned int i;
-	CACHE_ENTRY* cacheEntries = cache->cacheEntries;
-	unsigned int numberOfPages = cache->numberOfPages;
-	unsigned int sectorsPerPage = cache->sectorsPerPage;
 
-	bool foundFree = false;
-	unsigned int oldUsed = 0;
-	unsigned int oldAccess = UINT_MAX;
+void _FAT_cache_resetStats (CACHE* cache) {
+	memset (&cache->stats, 0, sizeof(CACHE_STATS));
+}
+
+#ifdef USE_WRITEBACK_THREAD
+static uint64_t _FAT_cache_clockMs (void) {
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+#endif
+
+static inline bool _FAT_cache_discRead (CACHE* cache, sec_t sector, sec_t numSectors, void* buffer) {
+	CACHE_STAT_ADD(cache,sectorsRead,numSectors);
+	return _FAT_disc_readSectors (cache->disc, sector, numSectors, buffer);
+}
 
-	for(i=0;i<numberOfPages;i++) {
-		if(sector>=cacheEntries[i].sector && sector<(cacheEntries[i].sector + cacheEntries[i].count)) {
-			cacheEntries[i].last_access = accessTime();
-			return &(cacheEntries[i]);
+static inline bool _FAT_cache_discWrite (CACHE* cache, sec_t sector, sec_t numSectors, const void* buffer) {
+	CACHE_STAT_ADD(cache,sectorsWritten,numSectors);
+	return _FAT_disc_writeSectors (cache->disc, sector, numSectors, buffer);
+}
+
+/*
+Set count bits of a per-sector page bitmap, starting at bit sec
+*/
+static void _FAT_cache_setBits (uint32_t* bitmap, sec_t sec, sec_t count) {
+	while (count > 0) {
+		if (((sec & 31) == 0) && (count >= 32)) {
+			bitmap[sec >> 5] = 0xFFFFFFFF;
+			sec += 32;
+			count -= 32;
+		} else {
+			bitmap[sec >> 5] |= (uint32_t)1 << (sec & 31);
+			sec++;
+			count--;
 		}
+	}
+}
 
-		if(foundFree==false && (cacheEntries[i].sector==CACHE_FREE || cacheEntries[i].last_access<oldAccess)) {
-			if(cacheEntries[i].sector==CACHE_FREE) foundFree = true;
-			oldUsed = i;
-			oldAccess = cacheEntries[i].last_access;
+/*
+Clear count bits of a per-sector page bitmap, starting at bit sec
+*/
+static void _FAT_cache_clearBits (uint32_t* bitmap, sec_t sec, sec_t count) {
+	while (count > 0) {
+		if (((sec & 31) == 0) && (count >= 32)) {
+			bitmap[sec >> 5] = 0;
+			sec += 32;
+			count -= 32;
+		} else {
+			bitmap[sec >> 5] &= ~((uint32_t)1 << (sec & 31));
+			sec++;
+			count--;
 		}
 	}
+}
+
+static inline bool _FAT_cache_testBit (const uint32_t* bitmap, sec_t sec) {
+	return (bitmap[sec >> 5] >> (sec & 31)) & 1;
+}
+
+/*
+Mark count sectors of a page, starting at sector offset sec within
+the page, as holding new data that needs writing back
+*/
+static void _FAT_cache_markDirty (CACHE_ENTRY* entry, sec_t sec, sec_t count) {
+	_FAT_cache_setBits (entry->validSectors, sec, count);
+	_FAT_cache_setBits (entry->dirtySectors, sec, count);
+#ifdef USE_WRITEBACK_THREAD
+	if (!entry->dirty) {
+		entry->dirtySince = _FAT_cache_clockMs ();
+	}
+#endif
+	entry->dirty = true;
+}
+
+static inline bool _FAT_cache_isSectorDirty (const CACHE_ENTRY* entry, sec_t sec) {
+	return _FAT_cache_testBit (entry->dirtySectors, sec);
+}
+
+/*
+Completion of a queued read-ahead into a page. The sectors only count as
+valid once they have arrived; a failed read leaves them to be read again.
+*/
+static void _FAT_cache_asyncReadDone (void* token, bool success) {
+	CACHE_ENTRY* entry = (CACHE_ENTRY*)token;
+
+	entry->ioPending = false;
+	if (success) {
+		_FAT_cache_setBits (entry->validSectors, 0, entry->count);
+		entry->complete = true;
+	}
+}
+
+static void _FAT_cache_asyncWriteDone (void* token, bool success) {
+	if (!success) {
+		((CACHE*)token)->asyncFailed = true;
+	}
+}
 
-	if(foundFree==false && cacheEntries[oldUsed].dirty==true) {
-		if(!_FAT_disc_writeSectors(cache->disc,cacheEntries[oldUsed].sector,cacheEntries[oldUsed].count,cacheEntries[oldUsed].cache)) return NULL;
-		cacheEntries[oldUsed].dirty = false;
+/*
+Queue a read of a whole page. Returns false if the disc has no queue or
+it is full, in which case the caller reads the page the blocking way.
+*/
+static bool _FAT_cache_submitPageRead (CACHE* cache, CACHE_ENTRY* entry) {
+	if ((cache->async == NULL) ||
+		!_FAT_disc_submitReadSectors (cache->async, entry->sector, entry->count, entry->cache, _FAT_cache_asyncReadDone, entry))
+	{
+		return false;
+	}
+	entry->ioPending = true;
+	cache->asyncPending = true;
+	CACHE_STAT_ADD(cache,sectorsRead,entry->count);
+	CACHE_STAT_ADD(cache,queuedTransfers,1);
+	return true;
+}
+
+/*
+Queue a write. Returns false if the disc has no queue or it is full,
+in which case the caller writes the sectors the blocking way.
+*/
+static bool _FAT_cache_submitWrite (CACHE* cache, sec_t sector, sec_t numSectors, const void* buffer) {
+	if ((cache->async == NULL) ||
+		!_FAT_disc_submitWriteSectors (cache->async, sector, numSectors, buffer, _FAT_cache_asyncWriteDone, cache))
+	{
+		return false;
+	}
+	cache->asyncPending = true;
+	CACHE_STAT_ADD(cache,sectorsWritten,numSectors);
+	CACHE_STAT_ADD(cache,queuedTransfers,1);
+	return true;
+}
+
+/*
+Wait for every transfer queued by this cache to complete.
+Returns false if a queued write failed.
+*/
+static bool _FAT_cache_asyncDrain (CACHE* cache) {
+	bool ok;
+
+	if (!cache->asyncPending) {
+		return true;
+	}
+	ok = _FAT_disc_wait (cache->async) && !cache->asyncFailed;
+	cache->asyncPending = false;
+	cache->asyncFailed = false;
+	cache->stagingBusy = false;
+	return ok;
+}
+
+/*
+Make sure count sectors of a page, starting at offset sec, hold the
+disc's data. Only sectors that have neither been read nor written are
+loaded, one read per run of such sectors.
+*/
+static bool _FAT_cache_fillSectors (CACHE* cache, CACHE_ENTRY* entry, sec_t sec, sec_t count) {
+	sec_t end = sec + count;
+	sec_t runStart;
+	bool wholePage = (sec == 0) && (count == entry->count);
+
+	if (entry->complete) {
+		return true;
+	}
+
+	while (sec < end) {
+		if (_FAT_cache_testBit (entry->validSectors, sec)) {
+			sec++;
+			continue;
+		}
+
+		runStart = sec;
+		while ((sec < end) && !_FAT_cache_testBit (entry->validSectors, sec)) {
+			sec++;
+		}
+
+		if (!_FAT_cache_discRead (cache, entry->sector + runStart, sec - runStart,
+			entry->cache + (runStart * cache->bytesPerSector)))
+		{
+			return false;
+		}
+		_FAT_cache_setBits (entry->validSectors, runStart, sec - runStart);
+	}
+
+	if (wholePage) {
+		entry->complete = true;
+	}
+
+	return true;
+}
+
+/*
+Write the dirty sectors of a page back to disc and mark the page clean.
+Each run of consecutive dirty sectors goes out as a single write.
+*/
+static bool _FAT_cache_writebackPage (CACHE* cache, CACHE_ENTRY* entry) {
+	sec_t sec = 0;
+	sec_t runStart;
+
+	if (!entry->dirty) {
+		return true;
+	}
+
+	while (sec < entry->count) {
+		if (entry->dirtySectors[sec >> 5] == 0) {
+			// Skip a whole clean word at a time
+			sec = (sec | 31) + 1;
+			continue;
+		}
+		if (!_FAT_cache_isSectorDirty (entry, sec)) {
+			sec++;
+			continue;
+		}
+
+		runStart = sec;
+		while ((sec < entry->count) && _FAT_cache_isSectorDirty (entry, sec)) {
+			sec++;
+		}
+
+		if (!_FAT_cache_discWrite (cache, entry->sector + runStart, sec - runStart,
+			entry->cache + (runStart * cache->bytesPerSector)))
+		{
+			return false;
+		}
+	}
+
+	memset (entry->dirtySectors, 0, sizeof(uint32_t) * cache->bitmapWords);
+	entry->dirty = false;
+	CACHE_STAT_ADD(cache,dirtyWritebacks,1);
+	return true;
+}
+
+/*
+Hash a page's base sector into a bucket index
+*/
+static inline unsigned int _FAT_cache_hash (CACHE* cache, sec_t pageSector) {
+	return ((pageSector / cache->sectorsPerPage) * 2654435761u) >> (32 - cache->hashBits);
+}
+
+static void _FAT_cache_hashInsert (CACHE* cache, unsigned int page) {
+	unsigned int bucket = _FAT_cache_hash (cache, cache->cacheEntries[page].sector);
+
+	cache->cacheEntries[page].hashNext = cache->hashBuckets[bucket];
+	cache->hashBuckets[bucket] = page;
+	// A sector borrowed from a mapped disc may now have a newer copy in this page
+	cache->generation++;
+}
+
+static void _FAT_cache_hashRemove (CACHE* cache, unsigned int page) {
+	unsigned int* link = &cache->hashBuckets[_FAT_cache_hash (cache, cache->cacheEntries[page].sector)];
+
+	while (*link != HASH_END) {
+		if (*link == page) {
+			*link = cache->cacheEntries[page].hashNext;
+			break;
+		}
+		link = &cache->cacheEntries[*link].hashNext;
+	}
+	cache->cacheEntries[page].hashNext = HASH_END;
+	cache->generation++;
+}
+
+/*
+Find the page holding sector, or return NULL if it is not cached.
+Pages always start on a multiple of sectorsPerPage, so the page's
+base sector is the lookup key.
+*/
+static CACHE_ENTRY* _FAT_cache_findPage (CACHE* cache, sec_t sector) {
+	sec_t pageSector = (sector / cache->sectorsPerPage) * cache->sectorsPerPage;
+	unsigned int i = cache->hashBuckets[_FAT_cache_hash (cache, pageSector)];
+
+	while (i != HASH_END) {
+		if (cache->cacheEntries[i].sector == pageSector) {
+			return &(cache->cacheEntries[i]);
+		}
+		i = cache->cacheEntries[i].hashNext;
+	}
+	return NULL;
+}
+
+/*
+Hash a page's base sector into a ghost bucket index
+*/
+static inline unsigned int _FAT_cache_ghostHash (CACHE* cache, sec_t pageSector) {
+	return ((pageSector / cache->sectorsPerPage) * 2654435761u) >> (32 - cache->ghostHashBits);
+}
+
+/*
+Check whether a page was recently pushed out of the 2Q first-touch
+queue, forgetting it if so, since it is about to be loaded again.
+*/
+static bool _FAT_cache_ghostTake (CACHE* cache, sec_t pageSector) {
+	unsigned int* link = &cache->ghostBuckets[_FAT_cache_ghostHash (cache, pageSector)];
+	unsigned int slot;
+
+	while (*link != HASH_END) {
+		slot = *link;
+		if (cache->ghostSectors[slot] == pageSector) {
+			*link = cache->ghostHashNext[slot];
+			cache->ghostHashNext[slot] = HASH_END;
+			cache->ghostSectors[slot] = CACHE_FREE;
+			return true;
+		}
+		link = &cache->ghostHashNext[slot];
+	}
+	return false;
+}
+
+/*
+Remember a page pushed out of the 2Q first-touch queue, in place of
+the oldest one remembered
+*/
+static void _FAT_cache_ghostPut (CACHE* cache, sec_t pageSector) {
+	unsigned int slot = cache->ghostNext;
+	unsigned int bucket;
+
+	if (cache->ghostSectors[slot] != CACHE_FREE) {
+		_FAT_cache_ghostTake (cache, cache->ghostSectors[slot]);
+	}
+
+	bucket = _FAT_cache_ghostHash (cache, pageSector);
+	cache->ghostSectors[slot] = pageSector;
+	cache->ghostHashNext[slot] = cache->ghostBuckets[bucket];
+	cache->ghostBuckets[bucket] = slot;
+	cache->ghostNext = (slot + 1) % cache->ghostSize;
+}
+
+/*
+Pick the page to replace: a free page if there is one. Otherwise under
+2Q the oldest first-touch page while that queue is over its target size,
+and the least recently used page in all other cases. Pages with a queued
+read are skipped; CACHE_FREE is returned if that leaves none.
+*/
+static unsigned int _FAT_cache_findVictim (CACHE* cache) {
+	CACHE_ENTRY* cacheEntries = cache->cacheEntries;
+	unsigned int oldRecent = CACHE_FREE, oldFrequent = CACHE_FREE;
+	uint64_t recentAccess = UINT64_MAX, frequentAccess = UINT64_MAX;
+	unsigned int i;
+
+	for (i = 0; i < cache->numberOfPages; i++) {
+		if (cacheEntries[i].sector == CACHE_FREE) {
+			return i;
+		}
+		if (cacheEntries[i].ioPending) {
+			// A queued read is still filling it
+			continue;
+		}
+		if (cacheEntries[i].frequent) {
+			if (cacheEntries[i].last_access < frequentAccess) {
+				oldFrequent = i;
+				frequentAccess = cacheEntries[i].last_access;
+			}
+		} else if (cacheEntries[i].last_access < recentAccess) {
+			oldRecent = i;
+			recentAccess = cacheEntries[i].last_access;
+		}
+	}
+
+	if ((oldRecent != CACHE_FREE) && ((cache->recentPages > cache->recentTarget) || (oldFrequent == CACHE_FREE))) {
+		return oldRecent;
+	}
+	return oldFrequent;
+}
+
+/*
+Return the page holding sector, making room for it if it isn't cached.
+A newly allocated page holds no data until it is filled. If fill is set,
+any sectors of the page not yet valid are read from disc. Callers that
+are about to overwrite whole sectors pass false to skip the read.
+*/
+static CACHE_ENTRY* _FAT_cache_getPage(CACHE *cache,sec_t sector,bool fill)
+{
+	CACHE_ENTRY* cacheEntries = cache->cacheEntries;
+	unsigned int sectorsPerPage = cache->sectorsPerPage;
+	CACHE_ENTRY* entry;
+	unsigned int oldUsed;
+
+	entry = _FAT_cache_findPage(cache,sector);
+	if(entry!=NULL) {
+		if(entry->ioPending) _FAT_cache_asyncDrain(cache);
+		CACHE_STAT_ADD(cache,hits,1);
+		if(entry->prefetched) {
+			entry->prefetched = false;
+			cache->readAheadPending--;
+			cache->readAheadHits++;
+		}
+		// First-touch pages keep their load order, so repeated hits from
+		// a single scan don't make them look frequently used
+		if(entry->frequent) entry->last_access = accessTime(cache);
+		if(fill && !_FAT_cache_fillSectors(cache,entry,0,entry->count)) return NULL;
+		return entry;
+	}
+
+	// Not cached, so pick a page to replace
+	CACHE_STAT_ADD(cache,misses,1);
+	oldUsed = _FAT_cache_findVictim(cache);
+	if(oldUsed==CACHE_FREE) {
+		_FAT_cache_asyncDrain(cache);
+		oldUsed = _FAT_cache_findVictim(cache);
+	}
+
+	if(cacheEntries[oldUsed].sector!=CACHE_FREE) {
+		CACHE_STAT_ADD(cache,evictions,1);
+		if(!_FAT_cache_writebackPage(cache,&cacheEntries[oldUsed])) return NULL;
+		_FAT_cache_hashRemove(cache,oldUsed);
+		if(!cacheEntries[oldUsed].frequent) {
+			_FAT_cache_ghostPut(cache,cacheEntries[oldUsed].sector);
+			cache->recentPages--;
+		}
+		cacheEntries[oldUsed].sector = CACHE_FREE;
+		if(cacheEntries[oldUsed].prefetched) {
+			cacheEntries[oldUsed].prefetched = false;
+			cache->readAheadPending--;
+			cache->readAheadWasted++;
+		}
 	}
 
 	sector = (sector/sectorsPerPage)*sectorsPerPage; // align base sector to page size
 	sec_t next_page = sector + sectorsPerPage;
 	if(next_page > cache->endOfPartition)	next_page = cache->endOfPartition;
 
-	if(!_FAT_disc_readSectors(cache->disc,sector,next_page-sector,cacheEntries[oldUsed].cache)) return NULL;
+	entry = &cacheEntries[oldUsed];
+	memset(entry->validSectors,0,sizeof(uint32_t) * cache->bitmapWords);
+	entry->complete = false;
+	entry->sector = sector;
+	entry->count = next_page-sector;
+	entry->last_access = accessTime(cache);
+	if(cache->policy == CACHE_POLICY_2Q) {
+		entry->frequent = _FAT_cache_ghostTake(cache,sector);
+		if(!entry->frequent) cache->recentPages++;
+	}
+	_FAT_cache_hashInsert(cache,oldUsed);
+
+	if(fill && !_FAT_cache_fillSectors(cache,entry,0,entry->count)) return NULL;
+
+	return entry;
+}
+
+/*
+Count how many whole, uncached pages start at sector (which must be page
+aligned) and fit within numSectors. Such pages can be read straight into
+the caller's buffer without going through the cache.
+*/
+static sec_t _FAT_cache_uncachedRun(CACHE *cache,sec_t sector,sec_t numSectors)
+{
+	sec_t sectorsPerPage = cache->sectorsPerPage;
+	sec_t run = 0;
+
+	if((sector % sectorsPerPage) != 0) return 0;
+
+	while((numSectors - run) >= sectorsPerPage
+#ifdef LIMIT_SECTORS
+		&& (run + sectorsPerPage) <= LIMIT_SECTORS
+#endif
+		&& _FAT_cache_findPage(cache,sector + run)==NULL)
+	{
+		run += sectorsPerPage;
+	}
+
+	return run;
+}
+
+const void* _FAT_cache_borrowSectors (CACHE* cache, sec_t sector, sec_t numSectors)
+{
+	sec_t sectorsPerPage = cache->sectorsPerPage;
+	sec_t pageSector = (sector / sectorsPerPage) * sectorsPerPage;
+	sec_t end = sector + numSectors;
+	CACHE_ENTRY* entry;
+	const void* data;
+
+	entry = _FAT_cache_findPage(cache,sector);
+	if(entry==NULL && cache->mapped!=NULL) {
+		// The disc's copy is current as long as no page holds newer data
+		for(pageSector += sectorsPerPage; pageSector < end; pageSector += sectorsPerPage) {
+			if(_FAT_cache_findPage(cache,pageSector)!=NULL) return NULL;
+		}
+		data = _FAT_disc_mapSectors(cache->mapped,sector,numSectors);
+		if(data!=NULL) {
+			CACHE_STAT_ADD(cache,mappedSectors,numSectors);
+			return data;
+		}
+	}
 
-	cacheEntries[oldUsed].sector = sector;
-	cacheEntries[oldUsed].count = next_page-sector;
-	cacheEntries[oldUsed].last_access = accessTime();
+	if((sector % sectorsPerPage) + numSectors > sectorsPerPage) return NULL;
 
-	return &(cacheEntries[oldUsed]);
+	entry = _FAT_cache_getPage(cache,sector,true);
+	if(entry==NULL) return NULL;
+	return entry->cache + ((sector - entry->sector) * cache->bytesPerSector);
 }
 
 bool _FAT_cache_readSectors(CACHE *cache,sec_t sector,sec_t numSectors,void *buffer)
 {
 	sec_t sec;
 	sec_t secs_to_read;
-	CACHE_ENTRY *entry;
+	const uint8_t *src;
 	uint8_t *dest = (uint8_t *)buffer;
 
 	while(numSectors>0) {
-		entry = _FAT_cache_getPage(cache,sector);
-		if(entry==NULL) return false;
-
-		sec = sector - entry->sector;
-		secs_to_read = entry->count - sec;
-		if(secs_to_read>numSectors) secs_to_read = numSectors;
-
-		memcpy(dest,entry->cache + (sec*cache->bytesPerSector),(secs_to_read*cache->bytesPerSector));
+		// Whole pages that aren't cached bypass the cache, so large reads
+		// neither pay for a second copy nor evict FAT and directory pages.
+		// Cached pages may hold dirty data, so those are always copied out.
+		secs_to_read = _FAT_cache_uncachedRun(cache,sector,numSectors);
+		if(secs_to_read>0) {
+			if(!_FAT_cache_discRead(cache,sector,secs_to_read,dest)) return false;
+		} else {
+			sec = sector % cache->sectorsPerPage;
+			secs_to_read = cache->sectorsPerPage - sec;
+			if(secs_to_read>numSectors) secs_to_read = numSectors;
+
+			src = (const uint8_t*)_FAT_cache_borrowSectors(cache,sector,secs_to_read);
+			if(src==NULL) return false;
+
+			memcpy(dest,src,(secs_to_read*cache->bytesPerSector));
+			CACHE_STAT_ADD(cache,bytesCopied,secs_to_read*cache->bytesPerSector);
+		}
+		CACHE_STAT_ADD(cache,fullSectorReads,secs_to_read);
 
 		dest += (secs_to_read*cache->bytesPerSector);
 		sector += secs_to_read;
@@ -184,17 +820,18 @@ Reads some data from a cache page, determined by the sector number
 */
 bool _FAT_cache_readPartialSector (CACHE* cache, void* buffer, sec_t sector, unsigned int offset, size_t size)
 {
-	sec_t sec;
-	CACHE_ENTRY *entry;
+	const uint8_t *src;
 
 	if (offset + size > cache->bytesPerSector) return false;
 
-	entry = _FAT_cache_getPage(cache,sector);
-	if(entry==NULL) return false;
+	src = (const uint8_t*)_FAT_cache_borrowSectors(cache,sector,1);
+	if(src==NULL) return false;
 
-	sec = sector - entry->sector;
-	memcpy(buffer,entry->cache + ((sec*cache->bytesPerSector) + offset),size);
+	memcpy(buffer,src + offset,size);
 
+	CACHE_STAT_ADD(cache,bytesCopied,size);
+	if(size<cache->bytesPerSector) CACHE_STAT_ADD(cache,partialReads,1);
+	else CACHE_STAT_ADD(cache,fullSectorReads,1);
 	return true;
 }
 
@@ -221,16 +858,37 @@ bool _FAT_cache_writePartialSector (CACHE* cache, const void* buffer, sec_t sect
 
 	if (offset + size > cache->bytesPerSector) return false;
 
-	entry = _FAT_cache_getPage(cache,sector);
+	entry = _FAT_cache_getPage(cache,sector,false);
 	if(entry==NULL) return false;
 
+	// Only the sector being modified needs to be read in
 	sec = sector - entry->sector;
+	if(!_FAT_cache_fillSectors(cache,entry,sec,1)) return false;
 	memcpy(entry->cache + ((sec*cache->bytesPerSector) + offset),buffer,size);
 
-	entry->dirty = true;
+	CACHE_STAT_ADD(cache,bytesCopied,size);
+	if(size<cache->bytesPerSector) CACHE_STAT_ADD(cache,partialWrites,1);
+	else CACHE_STAT_ADD(cache,fullSectorWrites,1);
+	_FAT_cache_markDirty(entry,sec,1);
 	return true;
 }
 
+uint8_t* _FAT_cache_modifySector (CACHE* cache, sec_t sector)
+{
+	sec_t sec;
+	CACHE_ENTRY *entry;
+
+	entry = _FAT_cache_getPage(cache,sector,false);
+	if(entry==NULL) return NULL;
+
+	sec = sector - entry->sector;
+	if(!_FAT_cache_fillSectors(cache,entry,sec,1)) return NULL;
+
+	CACHE_STAT_ADD(cache,partialWrites,1);
+	_FAT_cache_markDirty(entry,sec,1);
+	return entry->cache + (sec*cache->bytesPerSector);
+}
+
 bool _FAT_cache_writeLittleEndianValue (CACHE* cache, const uint32_t value, sec_t sector, unsigned int offset, int size) {
   uint8_t buf[4] = {0, 0, 0, 0};
 
@@ -254,14 +912,17 @@ bool _FAT_cache_eraseWritePartialSector (CACHE* cache, const void* buffer, sec_t
 
 	if (offset + size > cache->bytesPerSector) return false;
 
-	entry = _FAT_cache_getPage(cache,sector);
+	// The whole sector is overwritten, so it never needs reading
+	entry = _FAT_cache_getPage(cache,sector,false);
 	if(entry==NULL) return false;
 
 	sec = sector - entry->sector;
 	memset(entry->cache + (sec*cache->bytesPerSector),0,cache->bytesPerSector);
 	memcpy(entry->cache + ((sec*cache->bytesPerSector) + offset),buffer,size);
 
-	entry->dirty = true;
+	CACHE_STAT_ADD(cache,bytesCopied,size);
+	CACHE_STAT_ADD(cache,fullSectorWrites,1);
+	_FAT_cache_markDirty(entry,sec,1);
 	return true;
 }
 
@@ -275,7 +936,8 @@ bool _FAT_cache_writeSectors (CACHE* cache, sec_t sector, sec_t numSectors, cons
 
 	while(numSectors>0)
 	{
-		entry = _FAT_cache_getPage(cache,sector);
+		// Whole sectors are overwritten, so they never need reading
+		entry = _FAT_cache_getPage(cache,sector,false);
 		if(entry==NULL) return false;
 
 		sec = sector - entry->sector;
@@ -283,41 +945,498 @@ bool _FAT_cache_writeSectors (CACHE* cache, sec_t sector, sec_t numSectors, cons
 		if(secs_to_write>numSectors) secs_to_write = numSectors;
 
 		memcpy(entry->cache + (sec*cache->bytesPerSector),src,(secs_to_write*cache->bytesPerSector));
+		_FAT_cache_markDirty(entry,sec,secs_to_write);
+		CACHE_STAT_ADD(cache,bytesCopied,secs_to_write*cache->bytesPerSector);
+		CACHE_STAT_ADD(cache,fullSectorWrites,secs_to_write);
 
 		src += (secs_to_write*cache->bytesPerSector);
 		sector += secs_to_write;
 		numSectors -= secs_to_write;
+	}
+	return true;
+}
+
+void _FAT_cache_setFlushMode (CACHE* cache, CACHE_FLUSH_MODE mode, sec_t maxTransfer) {
+	sec_t cacheSectors = cache->numberOfPages * cache->sectorsPerPage;
+
+	if (maxTransfer == 0 || maxTransfer > cacheSectors) {
+		maxTransfer = cacheSectors;
+	}
+#ifdef LIMIT_SECTORS
+	if (maxTransfer > LIMIT_SECTORS) {
+		maxTransfer = LIMIT_SECTORS;
+	}
+#endif
+
+	// The staging buffer is sized for the old limit, so drop it
+	if (cache->stagingBuffer && maxTransfer != cache->maxTransfer) {
+		_FAT_mem_free (cache->stagingBuffer);
+		cache->stagingBuffer = NULL;
+	}
+
+	cache->flushMode = mode;
+	cache->maxTransfer = maxTransfer;
+}
 
-		entry->dirty = true;
+void _FAT_cache_setReadAhead (CACHE* cache, unsigned int windowPages, unsigned int maxInFlightPages) {
+	// Leave at least half the cache for pages that are actually in use
+	if (windowPages > cache->numberOfPages / 2) {
+		windowPages = cache->numberOfPages / 2;
+	}
+	if (maxInFlightPages > cache->numberOfPages / 2) {
+		maxInFlightPages = cache->numberOfPages / 2;
+	}
+	if (maxInFlightPages == 0) {
+		windowPages = 0;
+	}
+
+	cache->readAheadWindow = windowPages;
+	cache->readAheadInFlight = maxInFlightPages;
+}
+
+unsigned int _FAT_cache_readAheadWindow (CACHE* cache, CACHE_READAHEAD* stream, uint32_t position, uint32_t length) {
+	if (position == stream->nextPosition) {
+		// Start small and double, so a reader that stops early wastes little
+		if (stream->window == 0) {
+			stream->window = 1;
+		} else if (stream->window < cache->readAheadWindow) {
+			stream->window *= 2;
+		}
+		if (stream->window > cache->readAheadWindow) {
+			stream->window = cache->readAheadWindow;
+		}
+	} else {
+		stream->window = 0;
+	}
+
+	stream->nextPosition = position + length;
+	return stream->window;
+}
+
+/*
+Read numSectors sectors from sector, which must be page aligned, into newly
+allocated pages. When more than one page is needed and the staging buffer is
+available, the whole run is read at once and then copied into the pages.
+*/
+static bool _FAT_cache_prefetchRun (CACHE* cache, sec_t sector, sec_t numSectors) {
+	unsigned int bytesPerSector = cache->bytesPerSector;
+	CACHE_ENTRY* entry;
+	sec_t offset, count;
+	bool staged;
+
+	// A queued disc reads straight into each page, several pages at a time
+	if (cache->async != NULL) {
+		for (offset = 0; offset < numSectors; offset += count) {
+			entry = _FAT_cache_getPage (cache, sector + offset, false);
+			if (entry == NULL) {
+				return false;
+			}
+			count = entry->count;
+			if (!_FAT_cache_submitPageRead (cache, entry) && !_FAT_cache_fillSectors (cache, entry, 0, count)) {
+				return false;
+			}
+			entry->prefetched = true;
+			cache->readAheadPending++;
+		}
+		return true;
+	}
+
+	if (cache->stagingBuffer == NULL) {
+		cache->stagingBuffer = (uint8_t*) _FAT_mem_align (cache->maxTransfer * bytesPerSector);
+	}
+	staged = (numSectors > cache->sectorsPerPage) && (cache->stagingBuffer != NULL);
+
+	if (staged && !_FAT_cache_discRead (cache, sector, numSectors, cache->stagingBuffer)) {
+		return false;
+	}
+
+	for (offset = 0; offset < numSectors; offset += count) {
+		entry = _FAT_cache_getPage (cache, sector + offset, !staged);
+		if (entry == NULL) {
+			return false;
+		}
+		count = entry->count;
+		if (staged) {
+			memcpy (entry->cache, cache->stagingBuffer + (offset * bytesPerSector), count * bytesPerSector);
+			CACHE_STAT_ADD(cache,bytesCopied,count * bytesPerSector);
+			_FAT_cache_setBits (entry->validSectors, 0, count);
+			entry->complete = true;
+		}
+		entry->prefetched = true;
+		cache->readAheadPending++;
+	}
+
+	return true;
+}
+
+void _FAT_cache_prefetch (CACHE* cache, sec_t sector, sec_t numSectors) {
+	sec_t sectorsPerPage = cache->sectorsPerPage;
+	sec_t pageSector = (sector / sectorsPerPage) * sectorsPerPage;
+	sec_t end = sector + numSectors;
+	sec_t runStart, runEnd;
+	unsigned int budget, leading;
+
+	// Reads of a disc held in memory never go through cache pages
+	if ((cache->mapped != NULL) || (cache->readAheadPending >= cache->readAheadInFlight)) {
+		return;
+	}
+	budget = cache->readAheadInFlight - cache->readAheadPending;
+
+	if (end > cache->endOfPartition) {
+		end = cache->endOfPartition;
+	}
+
+	// Wait until less than half the window is left cached ahead of the
+	// reader, so the rest can be fetched in a single batch
+	leading = 0;
+	while ((pageSector < end) && (_FAT_cache_findPage (cache, pageSector) != NULL)) {
+		pageSector += sectorsPerPage;
+		leading++;
+	}
+	if ((pageSector >= end) || ((leading > 0) && (leading * 2 >= numSectors / sectorsPerPage))) {
+		return;
+	}
+
+	while ((pageSector < end) && (budget > 0)) {
+		if (_FAT_cache_findPage (cache, pageSector) != NULL) {
+			pageSector += sectorsPerPage;
+			continue;
+		}
+
+		// Gather consecutive uncached pages that fit in one transfer
+		runStart = pageSector;
+		do {
+			pageSector += sectorsPerPage;
+			budget--;
+		} while ((pageSector < end) && (budget > 0) &&
+			(pageSector + sectorsPerPage - runStart <= cache->maxTransfer) &&
+			(_FAT_cache_findPage (cache, pageSector) == NULL));
+
+		runEnd = pageSector;
+		if (runEnd > cache->endOfPartition) {
+			runEnd = cache->endOfPartition;
+		}
+
+		if (!_FAT_cache_prefetchRun (cache, runStart, runEnd - runStart)) {
+			return;
+		}
+	}
+}
+
+/*
+A run of sectors waiting to be written during a coalesced flush.
+While it only holds one run, data points into the page itself.
+Once a second run is merged in, the data is staged in stagingBuffer.
+*/
+typedef struct {
+	sec_t          sector;
+	sec_t          count;
+	const uint8_t* data;
+	bool           staged;
+} FLUSH_RUN;
+
+static bool _FAT_cache_writeFlushRun (CACHE* cache, FLUSH_RUN* run) {
+	if (run->count == 0) {
+		return true;
+	}
+	if (_FAT_cache_submitWrite (cache, run->sector, run->count, run->data)) {
+		if (run->staged) {
+			cache->stagingBusy = true;
+		}
+	} else if (!_FAT_cache_discWrite (cache, run->sector, run->count, run->data)) {
+		return false;
 	}
+	run->count = 0;
 	return true;
 }
 
 /*
-Flushes all dirty pages to disc, clearing the dirty flag.
+Add a run of dirty sectors to the pending write, merging it if it
+directly follows the pending run and the result fits in maxTransfer.
+Otherwise the pending run is written out and replaced.
+*/
+static bool _FAT_cache_addFlushRun (CACHE* cache, FLUSH_RUN* run, sec_t sector, sec_t count, const uint8_t* data) {
+	unsigned int bytesPerSector = cache->bytesPerSector;
+
+	if ((run->count > 0) && (run->sector + run->count == sector) &&
+		(run->count + count <= cache->maxTransfer) && (cache->stagingBuffer != NULL))
+	{
+		if (!run->staged) {
+			// The staging buffer may still be feeding a queued write
+			if (cache->stagingBusy && !_FAT_cache_asyncDrain (cache)) {
+				return false;
+			}
+			memcpy (cache->stagingBuffer, run->data, run->count * bytesPerSector);
+			CACHE_STAT_ADD(cache,bytesCopied,run->count * bytesPerSector);
+			run->data = cache->stagingBuffer;
+			run->staged = true;
+		}
+		memcpy (cache->stagingBuffer + (run->count * bytesPerSector), data, count * bytesPerSector);
+		CACHE_STAT_ADD(cache,bytesCopied,count * bytesPerSector);
+		run->count += count;
+		cache->flushCallsSaved++;
+		return true;
+	}
+
+	if (!_FAT_cache_writeFlushRun (cache, run)) {
+		return false;
+	}
+
+	run->sector = sector;
+	run->count = count;
+	run->data = data;
+	run->staged = false;
+	return true;
+}
+
+static int _FAT_cache_compareSector (const void* a, const void* b) {
+	sec_t sectorA = (*(CACHE_ENTRY* const*)a)->sector;
+	sec_t sectorB = (*(CACHE_ENTRY* const*)b)->sector;
+
+	return (sectorA > sectorB) - (sectorA < sectorB);
+}
+
+/*
+Write back the dirty sectors of every page that became dirty before
+dirtyBefore, in ascending sector order, merging physically adjacent
+runs, even across pages, into single writes. Returns the number of
+pages written back in pagesWritten.
+*/
+static bool _FAT_cache_flushCoalesced (CACHE* cache, uint64_t dirtyBefore, unsigned int* pagesWritten) {
+	unsigned int i, numDirty = 0;
+	CACHE_ENTRY* entry;
+	FLUSH_RUN run;
+	sec_t sec, runStart;
+
+	if (cache->flushOrder == NULL) {
+		cache->flushOrder = (CACHE_ENTRY**) _FAT_mem_allocate (sizeof(CACHE_ENTRY*) * cache->numberOfPages);
+	}
+	if (cache->stagingBuffer == NULL) {
+		cache->stagingBuffer = (uint8_t*) _FAT_mem_align (cache->maxTransfer * cache->bytesPerSector);
+	}
+	if (cache->flushOrder == NULL) {
+		// Not enough memory to sort, so fall back to writing pages in place
+		for (i = 0; i < cache->numberOfPages; i++) {
+			entry = &cache->cacheEntries[i];
+			if (!entry->dirty || entry->dirtySince >= dirtyBefore) {
+				continue;
+			}
+			if (!_FAT_cache_writebackPage (cache, entry)) {
+				return false;
+			}
+			numDirty++;
+		}
+		*pagesWritten = numDirty;
+		return true;
+	}
+
+	for (i = 0; i < cache->numberOfPages; i++) {
+		if (cache->cacheEntries[i].dirty && cache->cacheEntries[i].dirtySince < dirtyBefore) {
+			cache->flushOrder[numDirty++] = &cache->cacheEntries[i];
+		}
+	}
+	qsort (cache->flushOrder, numDirty, sizeof(CACHE_ENTRY*), _FAT_cache_compareSector);
+
+	run.count = 0;
+	for (i = 0; i < numDirty; i++) {
+		entry = cache->flushOrder[i];
+		sec = 0;
+		while (sec < entry->count) {
+			if (!_FAT_cache_isSectorDirty (entry, sec)) {
+				sec++;
+				continue;
+			}
+			runStart = sec;
+			while ((sec < entry->count) && _FAT_cache_isSectorDirty (entry, sec)) {
+				sec++;
+			}
+			if (!_FAT_cache_addFlushRun (cache, &run, entry->sector + runStart, sec - runStart,
+				entry->cache + (runStart * cache->bytesPerSector)))
+			{
+				return false;
+			}
+		}
+	}
+
+	// Only mark pages clean once everything is on disc, since the
+	// pending run and queued writes may still point into a page
+	if (!_FAT_cache_writeFlushRun (cache, &run) || !_FAT_cache_asyncDrain (cache)) {
+		return false;
+	}
+
+	for (i = 0; i < numDirty; i++) {
+		entry = cache->flushOrder[i];
+		memset (entry->dirtySectors, 0, sizeof(uint32_t) * cache->bitmapWords);
+		entry->dirty = false;
+	}
+	CACHE_STAT_ADD(cache,dirtyWritebacks,numDirty);
+	*pagesWritten = numDirty;
+
+	return true;
+}
+
+/*
+Flushes the dirty sectors of all pages to disc, clearing the dirty flags.
 */
 bool _FAT_cache_flush (CACHE* cache) {
 	unsigned int i;
 
+	if (cache->flushMode == CACHE_FLUSH_COALESCED) {
+		return _FAT_cache_flushCoalesced (cache, UINT64_MAX, &i);
+	}
+
+	for (i = 0; i < cache->numberOfPages; i++) {
+		if (!_FAT_cache_writebackPage (cache, &cache->cacheEntries[i])) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+#ifdef USE_WRITEBACK_THREAD
+/*
+Pages that became dirty before the returned time are due for background
+writeback. Over the dirty ratio every dirty page is due, otherwise only
+those older than maxAgeMs. 0 means nothing is due.
+*/
+static uint64_t _FAT_cache_writebackCutoff (CACHE* cache, uint32_t maxAgeMs, unsigned int dirtyRatio) {
+	unsigned int i, numDirty = 0;
+	uint64_t now;
+
 	for (i = 0; i < cache->numberOfPages; i++) {
 		if (cache->cacheEntries[i].dirty) {
-			if (!_FAT_disc_writeSectors (cache->disc, cache->cacheEntries[i].sector, cache->cacheEntries[i].count, cache->cacheEntries[i].cache)) {
-				return false;
+			numDirty++;
+		}
+	}
+	if (numDirty == 0) {
+		return 0;
+	}
+	if ((dirtyRatio > 0) && (numDirty * 100 > dirtyRatio * cache->numberOfPages)) {
+		return UINT64_MAX;
+	}
+
+	now = _FAT_cache_clockMs ();
+	if ((maxAgeMs == 0) || (now < maxAgeMs)) {
+		return 0;
+	}
+	return now - maxAgeMs + 1;
+}
+
+bool _FAT_cache_writebackDue (CACHE* cache, uint32_t maxAgeMs, unsigned int dirtyRatio) {
+	uint64_t dirtyBefore = _FAT_cache_writebackCutoff (cache, maxAgeMs, dirtyRatio);
+	unsigned int i;
+
+	for (i = 0; i < cache->numberOfPages; i++) {
+		if (cache->cacheEntries[i].dirty && cache->cacheEntries[i].dirtySince < dirtyBefore) {
+			return true;
+		}
+	}
+	return false;
+}
+
+bool _FAT_cache_writebackAged (CACHE* cache, uint32_t maxAgeMs, unsigned int dirtyRatio) {
+	uint64_t dirtyBefore = _FAT_cache_writebackCutoff (cache, maxAgeMs, dirtyRatio);
+	unsigned int pagesWritten = 0;
+	bool ret;
+
+	if (dirtyBefore == 0) {
+		return true;
+	}
+
+	// Batches always go out sorted and merged, whatever the flush mode
+	ret = _FAT_cache_flushCoalesced (cache, dirtyBefore, &pagesWritten);
+	CACHE_STAT_ADD(cache,backgroundWritebacks,pagesWritten);
+	return ret;
+}
+#endif
+
+/*
+Forget count sectors of a page, starting sec sectors into it
+*/
+static void _FAT_cache_discardInPage (CACHE* cache, CACHE_ENTRY* entry, sec_t sec, sec_t count) {
+	unsigned int i;
+
+	_FAT_cache_clearBits (entry->validSectors, sec, count);
+	_FAT_cache_clearBits (entry->dirtySectors, sec, count);
+	entry->complete = false;
+	cache->generation++;
+	entry->dirty = false;
+	for (i = 0; i < cache->bitmapWords; i++) {
+		if (entry->dirtySectors[i] != 0) {
+			entry->dirty = true;
+		}
+	}
+}
+
+void _FAT_cache_discardSectors (CACHE* cache, sec_t sector, sec_t numSectors) {
+	sec_t end = sector + numSectors;
+	sec_t pageEnd, sec, count;
+	CACHE_ENTRY* entry;
+	unsigned int i;
+
+	// A queued read completing later would mark the sectors valid again
+	_FAT_cache_asyncDrain (cache);
+
+	if (numSectors / cache->sectorsPerPage > cache->numberOfPages) {
+		// Checking every page is cheaper than looking up every page of a long range
+		for (i = 0; i < cache->numberOfPages; i++) {
+			entry = &cache->cacheEntries[i];
+			if ((entry->sector == CACHE_FREE) || (entry->sector >= end) || (entry->sector + entry->count <= sector)) {
+				continue;
 			}
+			sec = (entry->sector < sector) ? sector - entry->sector : 0;
+			count = ((entry->sector + entry->count < end) ? entry->count : end - entry->sector) - sec;
+			_FAT_cache_discardInPage (cache, entry, sec, count);
 		}
-		cache->cacheEntries[i].dirty = false;
+		return;
 	}
 
-	return true;
+	while (sector < end) {
+		pageEnd = (sector / cache->sectorsPerPage + 1) * cache->sectorsPerPage;
+		entry = _FAT_cache_findPage (cache, sector);
+		if (entry != NULL) {
+			sec = sector - entry->sector;
+			count = ((pageEnd < end) ? pageEnd : end) - sector;
+			if (sec + count > entry->count) {
+				count = entry->count - sec;
+			}
+			_FAT_cache_discardInPage (cache, entry, sec, count);
+		}
+		sector = pageEnd;
+	}
 }
 
 void _FAT_cache_invalidate (CACHE* cache) {
 	unsigned int i;
 	_FAT_cache_flush(cache);
+	_FAT_cache_asyncDrain(cache);
 	for (i = 0; i < cache->numberOfPages; i++) {
 		cache->cacheEntries[i].sector = CACHE_FREE;
 		cache->cacheEntries[i].last_access = 0;
 		cache->cacheEntries[i].count = 0;
 		cache->cacheEntries[i].dirty = false;
+		cache->cacheEntries[i].complete = false;
+		memset (cache->cacheEntries[i].dirtySectors, 0, sizeof(uint32_t) * cache->bitmapWords);
+		memset (cache->cacheEntries[i].validSectors, 0, sizeof(uint32_t) * cache->bitmapWords);
+		cache->cacheEntries[i].hashNext = HASH_END;
+		cache->cacheEntries[i].prefetched = false;
+		cache->cacheEntries[i].frequent = (cache->policy == CACHE_POLICY_LRU);
+		cache->cacheEntries[i].dirtySince = 0;
+	}
+	for (i = 0; i < (1u << cache->hashBits); i++) {
+		cache->hashBuckets[i] = HASH_END;
+	}
+	for (i = 0; i < cache->ghostSize; i++) {
+		cache->ghostSectors[i] = CACHE_FREE;
+		cache->ghostHashNext[i] = HASH_END;
+	}
+	if (cache->ghostBuckets) {
+		for (i = 0; i < (1u << cache->ghostHashBits); i++) {
+			cache->ghostBuckets[i] = HASH_END;
+		}
 	}
+	cache->recentPages = 0;
+	cache->readAheadPending = 0;
+	cache->generation++;
 }
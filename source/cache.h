@@ -42,18 +42,106 @@
 typedef struct {
 	sec_t        sector;
 	unsigned int count;
-	unsigned int last_access;
-	bool         dirty;
+	uint64_t     last_access;		// Value of the cache's accessCounter when last used
+	bool         dirty;				// Set if any sector in dirtySectors is set
+	bool         complete;			// Set once every sector in validSectors is set
+	uint32_t*    dirtySectors;		// One bit per sector of the page that needs writing back
+	uint32_t*    validSectors;		// One bit per sector of the page that holds disc or written data
 	uint8_t*     cache;
+	unsigned int hashNext;			// Next page in the same hash bucket
+	bool         prefetched;		// Loaded by read-ahead and not used since
+	bool         frequent;			// 2Q: referenced again after leaving the first-touch queue. Always set under LRU
+	bool         ioPending;			// A queued read into the page has not completed yet
+	uint64_t     dirtySince;		// Milliseconds clock when the page last went from clean to dirty. Only kept with USE_WRITEBACK_THREAD
 } CACHE_ENTRY;
 
+typedef enum {
+	CACHE_POLICY_LRU,			// Evict the least recently used page
+	CACHE_POLICY_2Q				// Keep first-touch pages in a small FIFO so sequential scans can't flush re-used pages
+} CACHE_POLICY;
+
+/*
+Sequential access state of one reader, such as an open file or a directory scan.
+Positions are in whatever unit the reader uses, as long as it is consistent.
+*/
+typedef struct {
+	uint32_t     nextPosition;		// Position of the next access if the reader stays sequential
+	unsigned int window;			// Pages to read ahead, doubled on each sequential access
+} CACHE_READAHEAD;
+
+/*
+Counters describing how the cache is used. Collected unless NO_CACHE_STATS is defined.
+The flush and read-ahead counters behind fatGetCacheFlushSavings and fatGetReadAheadStats
+are kept in CACHE instead, so they are always collected.
+fatGetCacheStats copies them into FAT_CACHE_STATS in fatcachestats.h.
+*/
+typedef struct {
+	uint32_t hits;					// Page lookups that found the page cached, including by read-ahead
+	uint32_t misses;				// Page lookups that needed a new page, including by read-ahead
+	uint32_t evictions;				// Pages replaced to make room for another
+	uint32_t dirtyWritebacks;		// Dirty pages written back, on eviction or flush
+	uint32_t sectorsRead;			// Sectors read from the disc
+	uint32_t sectorsWritten;		// Sectors written to the disc
+	uint32_t partialReads;			// Reads of part of a sector
+	uint32_t partialWrites;			// Writes of part of a sector
+	uint32_t fullSectorReads;		// Whole sectors read through the cache
+	uint32_t fullSectorWrites;		// Whole sectors written through the cache
+	uint64_t bytesCopied;			// Bytes copied between callers, pages and the staging buffer
+	uint32_t backgroundWritebacks;	// Dirty pages written back by the background writeback thread
+	uint32_t queuedTransfers;		// Reads and writes queued on a disc with FEATURE_MEDIUM_ASYNC
+	uint32_t mappedSectors;			// Sectors read in place from a disc with FEATURE_MEDIUM_MAPPED
+} CACHE_STATS;
+
+#ifdef NO_CACHE_STATS
+#define CACHE_STAT_ADD(cache,field,n)	do { } while (0)
+#else
+#define CACHE_STAT_ADD(cache,field,n)	((cache)->stats.field += (n))
+#endif
+
+typedef enum {
+	CACHE_FLUSH_PAGES,			// Write back each page on its own, in cache order
+	CACHE_FLUSH_COALESCED		// Sort dirty runs by sector and merge adjacent ones into larger writes
+} CACHE_FLUSH_MODE;
+
 typedef struct {
 	const DISC_INTERFACE* disc;
 	sec_t		          endOfPartition;
 	unsigned int          numberOfPages;
 	unsigned int          sectorsPerPage;
 	unsigned int          bytesPerSector;
+	unsigned int          bitmapWords;		// Number of uint32_t in each page's dirty and valid bitmaps
 	CACHE_ENTRY*          cacheEntries;
+	uint8_t*              pageArena;		// One block holding the buffers of all pages
+	size_t                pageArenaSize;
+	unsigned int*         hashBuckets;	// Index of the first page in each bucket, keyed on the page's base sector
+	unsigned int          hashBits;		// log2 of the number of buckets
+	uint64_t              accessCounter;	// Ticks once per page access, for least recently used ordering
+	CACHE_POLICY          policy;
+	unsigned int          recentPages;		// 2Q: pages in the first-touch queue
+	unsigned int          recentTarget;		// 2Q: size the first-touch queue is trimmed back to
+	sec_t*                ghostSectors;		// 2Q: ring of pages recently evicted from the first-touch queue
+	unsigned int*         ghostHashNext;	// 2Q: next ghostSectors slot in the same ghost bucket
+	unsigned int*         ghostBuckets;		// 2Q: first ghostSectors slot in each bucket, hashed like hashBuckets
+	unsigned int          ghostHashBits;	// 2Q: log2 of the number of ghost buckets
+	unsigned int          ghostSize;
+	unsigned int          ghostNext;		// 2Q: next slot to overwrite in ghostSectors
+	CACHE_FLUSH_MODE      flushMode;
+	sec_t                 maxTransfer;		// Largest number of sectors to merge into one coalesced write
+	uint8_t*              stagingBuffer;	// maxTransfer sectors for coalesced writes and read-ahead, allocated on first use
+	CACHE_ENTRY**         flushOrder;		// Dirty pages sorted by sector, allocated on first use
+	uint32_t              flushCallsSaved;	// Number of disc writes avoided by coalescing
+	unsigned int          readAheadWindow;	// Largest read-ahead window in pages, 0 disables read-ahead
+	unsigned int          readAheadInFlight;	// Most prefetched pages allowed to wait unused in the cache
+	unsigned int          readAheadPending;	// Prefetched pages currently waiting unused in the cache
+	uint32_t              readAheadHits;	// Prefetched pages that were later used
+	uint32_t              readAheadWasted;	// Prefetched pages evicted without being used
+	const DISC_INTERFACE_ASYNC* async;		// Queued transfer entry points, NULL if the disc only blocks
+	bool                  asyncPending;		// Transfers may have been queued since the last wait
+	bool                  asyncFailed;		// A queued write failed since the last wait
+	bool                  stagingBusy;		// A queued write is still reading from stagingBuffer
+	const DISC_INTERFACE_MAPPED* mapped;	// Direct access to a disc held in memory, or NULL
+	uint32_t              generation;		// Changes whenever a page is dropped or replaced, or sectors are discarded
+	CACHE_STATS           stats;
 } CACHE;
 
 /*
@@ -89,6 +177,29 @@ Precondition: offset + size <= BYTES_PER_READ
 */
 bool _FAT_cache_eraseWritePartialSector (CACHE* cache, const void* buffer, sec_t sector, unsigned int offset, size_t size);
 
+/*
+Return a pointer to numSectors sectors starting at sector without copying them, or NULL
+if they can't be reached in one piece. Uncached sectors of a disc with FEATURE_MEDIUM_MAPPED
+are borrowed straight from the disc, the rest from the cache page holding them.
+The pointer is only valid until the next call into the cache.
+*/
+const void* _FAT_cache_borrowSectors (CACHE* cache, sec_t sector, sec_t numSectors);
+
+/*
+Return a writable pointer to sector inside its cache page, reading it in first if needed,
+and mark it dirty, so a few bytes can be changed without a copy.
+The pointer is only valid until the next call into the cache.
+*/
+uint8_t* _FAT_cache_modifySector (CACHE* cache, sec_t sector);
+
+/*
+A pointer from _FAT_cache_borrowSectors stays valid, and keeps showing the current data,
+for as long as this value doesn't change.
+*/
+static inline uint32_t _FAT_cache_generation (CACHE* cache) {
+	return cache->generation;
+}
+
 /*
 Read several sectors from the cache
 */
@@ -115,14 +226,74 @@ Write any dirty sectors back to disc and clear out the contents of the cache
 */
 bool _FAT_cache_flush (CACHE* cache);
 
+/*
+Select how _FAT_cache_flush writes dirty sectors back.
+maxTransfer limits the size of a single coalesced write, in sectors.
+It is further capped at the size of the cache and at LIMIT_SECTORS.
+*/
+void _FAT_cache_setFlushMode (CACHE* cache, CACHE_FLUSH_MODE mode, sec_t maxTransfer);
+
+/*
+Configure read-ahead. windowPages is the largest number of pages read ahead of
+a sequential reader, and maxInFlightPages the most prefetched pages that may sit
+unused in the cache at once. Both are capped at half the cache. 0 disables it.
+*/
+void _FAT_cache_setReadAhead (CACHE* cache, unsigned int windowPages, unsigned int maxInFlightPages);
+
+/*
+Record an access of length units at position by a reader, and return the
+number of pages to read ahead of it. Returns 0 unless the access continues
+where the previous one ended.
+*/
+unsigned int _FAT_cache_readAheadWindow (CACHE* cache, CACHE_READAHEAD* stream, uint32_t position, uint32_t length);
+
+/*
+Load the uncached pages covering numSectors sectors from sector into the cache,
+batching consecutive pages into single reads. Nothing is read while at least half
+of the range is already cached. Best effort: errors are ignored, since the data
+will be read again on demand.
+*/
+void _FAT_cache_prefetch (CACHE* cache, sec_t sector, sec_t numSectors);
+
+/*
+Forget any cached data for numSectors sectors from sector, including changes
+not yet written back. Used when the clusters holding them are freed.
+*/
+void _FAT_cache_discardSectors (CACHE* cache, sec_t sector, sec_t numSectors);
+
+/*
+Zero all the statistics counters
+*/
+void _FAT_cache_resetStats (CACHE* cache);
+
+#ifdef USE_WRITEBACK_THREAD
+/*
+Return true if any dirty page has been dirty for at least maxAgeMs milliseconds,
+or more than dirtyRatio percent of the pages are dirty. 0 disables either check.
+*/
+bool _FAT_cache_writebackDue (CACHE* cache, uint32_t maxAgeMs, unsigned int dirtyRatio);
+
+/*
+Write back the pages that _FAT_cache_writebackDue would report, in ascending
+sector order with adjacent runs merged. Once over dirtyRatio, every dirty page goes.
+*/
+bool _FAT_cache_writebackAged (CACHE* cache, uint32_t maxAgeMs, unsigned int dirtyRatio);
+#endif
+
 /*
 Clear out the contents of the cache without writing any dirty sectors first
 */
 void _FAT_cache_invalidate (CACHE* cache);
 
-CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsPerPage, const DISC_INTERFACE* discInterface, sec_t endOfPartition, unsigned int bytesPerSector);
+CACHE* _FAT_cache_constructor (unsigned int numberOfPages, unsigned int sectorsPerPage, const DISC_INTERFACE* discInterface, sec_t endOfPartition, unsigned int bytesPerSector, CACHE_POLICY policy);
 
 void _FAT_cache_destructor (CACHE* cache);
 
+/*
+Rebuild cache with a new page count and page size, keeping its settings.
+Returns the new cache, or NULL with the old one still valid on failure.
+*/
+CACHE* _FAT_cache_resize (CACHE* cache, unsigned int numberOfPages, unsigned int sectorsPerPage);
+
 #endif // _CACHE_H
 
@@ -61,24 +61,95 @@
 #if   defined (__wii__)
    #define DEFAULT_CACHE_PAGES 4
    #define DEFAULT_SECTORS_PAGE 64
+   #define DEFAULT_CACHE_POLICY CACHE_POLICY_LRU
    #define USE_LWP_LOCK
    #define USE_RTC_TIME
 #elif defined (__gamecube__)
    #define DEFAULT_CACHE_PAGES 4
    #define DEFAULT_SECTORS_PAGE 64
+   #define DEFAULT_CACHE_POLICY CACHE_POLICY_LRU
    #define USE_LWP_LOCK
    #define USE_RTC_TIME
 #elif defined (NDS)
    #define DEFAULT_CACHE_PAGES 16
    #define DEFAULT_SECTORS_PAGE 8
+   #define DEFAULT_CACHE_POLICY CACHE_POLICY_LRU
+   #define DEFAULT_META_CACHE_PAGES 4
+   #define DEFAULT_META_SECTORS_PAGE 8
+   #define DEFAULT_FREE_CLUSTER_MAP false
+   #define DEFAULT_FILE_EXTENTS 1024
    //#define USE_RTC_TIME
 #elif defined (GBA)
    #define DEFAULT_CACHE_PAGES 2
    #define DEFAULT_SECTORS_PAGE 8
+   #define DEFAULT_CACHE_POLICY CACHE_POLICY_LRU
+   #define DEFAULT_READAHEAD_PAGES 0
+   #define DEFAULT_META_CACHE_PAGES 0
+   #define DEFAULT_FREE_CLUSTER_MAP false
+   #define DEFAULT_FILE_EXTENTS 32
    #define LIMIT_SECTORS 128
 #elif defined (GP2X)
   #define DEFAULT_CACHE_PAGES 16
   #define DEFAULT_SECTORS_PAGE 8
+  #define DEFAULT_CACHE_POLICY CACHE_POLICY_LRU
+#endif
+
+// Largest number of pages read ahead of a sequential reader
+#ifndef DEFAULT_READAHEAD_PAGES
+   #define DEFAULT_READAHEAD_PAGES 4
+#endif
+
+// Cache replacement policy, CACHE_POLICY_LRU or CACHE_POLICY_2Q. The embedded targets
+// above keep LRU, as their caches are too small for 2Q's first-touch queue to help
+#ifndef DEFAULT_CACHE_POLICY
+   #define DEFAULT_CACHE_POLICY CACHE_POLICY_2Q
+#endif
+
+// Separate cache pool for FAT and directory sectors. 0 pages shares the data cache
+#ifndef DEFAULT_META_CACHE_PAGES
+   #define DEFAULT_META_CACHE_PAGES 8
+#endif
+#ifndef DEFAULT_META_SECTORS_PAGE
+   #define DEFAULT_META_SECTORS_PAGE 16
+#endif
+#ifndef DEFAULT_META_CACHE_POLICY
+   #define DEFAULT_META_CACHE_POLICY CACHE_POLICY_LRU
+#endif
+
+// Keep a bitmap of free clusters in memory, one bit per cluster, so allocation
+// doesn't have to read through the FAT. fatMountWithMetaCache and fatSetFreeClusterMap
+// override it per partition
+#ifndef DEFAULT_FREE_CLUSTER_MAP
+   #define DEFAULT_FREE_CLUSTER_MAP true
+#endif
+
+// Most runs of contiguous clusters an open file remembers for seeking, reading and writing.
+// Past them the FAT chain is followed as usual
+#ifndef DEFAULT_FILE_EXTENTS
+   #define DEFAULT_FILE_EXTENTS 65536
+#endif
+
+// Define to leave the cache statistics counters out of the build
+//#define NO_CACHE_STATS
+
+// On the Linux host build, back the cache pages with transparent hugepages.
+// Define NO_HUGEPAGE_ARENA to use an ordinary allocation instead
+#if defined (__linux__) && !defined (NO_HUGEPAGE_ARENA)
+   #define USE_HUGEPAGE_ARENA
+#endif
+
+// On the Linux host build, allow a background thread per partition to write back
+// dirty cache pages. It needs a real partition lock, so pthread mutexes are used.
+// Define NO_WRITEBACK_THREAD to leave it out
+#if defined (__linux__) && !defined (NO_WRITEBACK_THREAD)
+   #define USE_WRITEBACK_THREAD
+   #define USE_PTHREAD_LOCK
+#endif
+
+// On the Linux host build, include the disc image backend (fatImageDisc).
+// Define NO_IMAGE_DISC to leave it out
+#if defined (__linux__) && !defined (NO_IMAGE_DISC)
+   #define USE_IMAGE_DISC
 #endif
 
 #include <stdbool.h>
@@ -109,6 +180,44 @@ typedef struct DISC_INTERFACE_STRUCT DISC_INTERFACE;
 
 #define FEATURE_MEDIUM_CANREAD      0x00000001
 #define FEATURE_MEDIUM_CANWRITE     0x00000002
+#define FEATURE_MEDIUM_ASYNC        0x00010000	// The interface is the base of a DISC_INTERFACE_ASYNC
+
+/*
+Optional queued transfers, for devices that need more than one request in flight.
+submitRead and submitWrite queue a transfer and return at once. If they return false
+the transfer was not queued and done is never called for it. done only ever runs
+inside poll or wait, on the thread that called them. poll completes whatever has
+finished without blocking and returns how many transfers that was. wait blocks until
+every queued transfer has completed and returns false if the device failed.
+*/
+typedef void (*FN_MEDIUM_COMPLETION)(void* token, bool success);
+typedef bool (*FN_MEDIUM_SUBMITREAD)(sec_t sector, sec_t numSectors, void* buffer, FN_MEDIUM_COMPLETION done, void* token);
+typedef bool (*FN_MEDIUM_SUBMITWRITE)(sec_t sector, sec_t numSectors, const void* buffer, FN_MEDIUM_COMPLETION done, void* token);
+typedef unsigned int (*FN_MEDIUM_POLL)(void);
+typedef bool (*FN_MEDIUM_WAIT)(void);
+
+typedef struct {
+	DISC_INTERFACE			base;			// features has FEATURE_MEDIUM_ASYNC set
+	FN_MEDIUM_SUBMITREAD	submitRead;
+	FN_MEDIUM_SUBMITWRITE	submitWrite;
+	FN_MEDIUM_POLL			poll;
+	FN_MEDIUM_WAIT			wait;
+} DISC_INTERFACE_ASYNC;
+
+#define FEATURE_MEDIUM_MAPPED       0x00020000	// The interface is the base of a DISC_INTERFACE_MAPPED
+
+/*
+Optional direct access to a disc that is held in memory, such as a memory mapped image.
+mapSectors returns a pointer to numSectors sectors starting at sector, valid until the
+disc is shut down, or NULL if they can't be reached that way. Writes still go through
+writeSectors, which must update what mapSectors points at.
+*/
+typedef const void* (*FN_MEDIUM_MAPSECTORS)(sec_t sector, sec_t numSectors);
+
+typedef struct {
+	DISC_INTERFACE			base;			// features has FEATURE_MEDIUM_MAPPED set
+	FN_MEDIUM_MAPSECTORS	mapSectors;
+} DISC_INTERFACE_MAPPED;
 
 #ifndef _SYS_REENT_H_
 #define _SYS_REENT_H_
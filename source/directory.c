@@ -283,6 +283,25 @@ static bool _FAT_directory_incrementDirEntryPosition (PARTITION* partition, DIR_
 	return true;
 }
 
+/*
+Called as a scan moves onto a new directory sector. Once the scan has
+been sequential for a while, the rest of the directory is prefetched,
+as far as its clusters are contiguous.
+*/
+static void _FAT_directory_readAhead (PARTITION* partition, const DIR_ENTRY_POSITION* position) {
+	CACHE* cache = partition->metaCache;
+	sec_t sector = _FAT_fat_clusterToSector (partition, position->cluster) + position->sector;
+	unsigned int pages;
+
+	pages = _FAT_cache_readAheadWindow (cache, &partition->dirReadAhead, sector, 1);
+	if (pages == 0) {
+		return;
+	}
+
+	_FAT_cache_prefetch (cache, sector, _FAT_fat_contiguousSectors (partition, position->cluster, position->sector,
+		pages * cache->sectorsPerPage));
+}
+
 bool _FAT_directory_getNextEntry (PARTITION* partition, DIR_ENTRY* entry) {
 	DIR_ENTRY_POSITION entryStart;
 	DIR_ENTRY_POSITION entryEnd;
@@ -316,7 +335,11 @@ bool _FAT_directory_getNextEntry (PARTITION* partition, DIR_ENTRY* entry) {
 			break;
 		}
 
-		_FAT_cache_readPartialSector (partition->cache, entryData,
+		if (entryEnd.offset == 0) {
+			_FAT_directory_readAhead (partition, &entryEnd);
+		}
+
+		_FAT_cache_readPartialSector (partition->metaCache, entryData,
 			_FAT_fat_clusterToSector(partition, entryEnd.cluster) + entryEnd.sector,
 			entryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 
@@ -442,7 +465,7 @@ bool _FAT_directory_getVolumeLabel (PARTITION* partition, char *label) {
 	end = false;
 	//this entry should be among the first 3 entries in the root directory table, if not, then system can have trouble displaying the right volume label
 	while(!end) {
-		if(!_FAT_cache_readPartialSector (partition->cache, entryData,
+		if(!_FAT_cache_readPartialSector (partition->metaCache, entryData,
 			_FAT_fat_clusterToSector(partition, entryEnd.cluster) + entryEnd.sector,
 			entryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE))
 		{ //error reading
@@ -482,7 +505,7 @@ bool _FAT_directory_entryFromPosition (PARTITION* partition, DIR_ENTRY* entry) {
 		entryStillValid && !finished;
 		entryStillValid = _FAT_directory_incrementDirEntryPosition (partition, &entryStart, false))
 	{
-		_FAT_cache_readPartialSector (partition->cache, entryData,
+		_FAT_cache_readPartialSector (partition->metaCache, entryData,
 			_FAT_fat_clusterToSector(partition, entryStart.cluster) + entryStart.sector,
 			entryStart.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 
@@ -664,9 +687,9 @@ bool _FAT_directory_removeEntry (PARTITION* partition, DIR_ENTRY* entry) {
 		entryStillValid && !finished;
 		entryStillValid = _FAT_directory_incrementDirEntryPosition (partition, &entryStart, false))
 	{
-		_FAT_cache_readPartialSector (partition->cache, entryData, _FAT_fat_clusterToSector(partition, entryStart.cluster) + entryStart.sector, entryStart.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+		_FAT_cache_readPartialSector (partition->metaCache, entryData, _FAT_fat_clusterToSector(partition, entryStart.cluster) + entryStart.sector, entryStart.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 		entryData[0] = DIR_ENTRY_FREE;
-		_FAT_cache_writePartialSector (partition->cache, entryData, _FAT_fat_clusterToSector(partition, entryStart.cluster) + entryStart.sector, entryStart.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+		_FAT_cache_writePartialSector (partition->metaCache, entryData, _FAT_fat_clusterToSector(partition, entryStart.cluster) + entryStart.sector, entryStart.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 		if ((entryStart.cluster == entryEnd.cluster) && (entryStart.sector == entryEnd.sector) && (entryStart.offset == entryEnd.offset)) {
 			finished = true;
 		}
@@ -698,7 +721,7 @@ static bool _FAT_directory_findEntryGap (PARTITION* partition, DIR_ENTRY* entry,
 	endOfDirectory = false;
 
 	while (entryStillValid && !endOfDirectory && (dirEntryRemain > 0)) {
-		_FAT_cache_readPartialSector (partition->cache, entryData,
+		_FAT_cache_readPartialSector (partition->metaCache, entryData,
 			_FAT_fat_clusterToSector(partition, gapEnd.cluster) + gapEnd.sector,
 			gapEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 		if (entryData[0] == DIR_ENTRY_LAST) {
@@ -739,7 +762,7 @@ static bool _FAT_directory_findEntryGap (PARTITION* partition, DIR_ENTRY* entry,
 			entryStillValid = _FAT_directory_incrementDirEntryPosition (partition, &gapEnd, true);
 			-- dirEntryRemain;
 			// Fill the entry with blanks
-			_FAT_cache_writePartialSector (partition->cache, entryData,
+			_FAT_cache_writePartialSector (partition->metaCache, entryData,
 				_FAT_fat_clusterToSector(partition, gapEnd.cluster) + gapEnd.sector,
 				gapEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 		}
@@ -1067,10 +1090,10 @@ bool _FAT_directory_addEntry (PARTITION* partition, DIR_ENTRY* entry, uint32_t d
 				lfnEntry[LFN_offset_flag] = ATTRIB_LFN;
 				lfnEntry[LFN_offset_reserved1] = 0;
 				u16_to_u8array (lfnEntry, LFN_offset_reserved2, 0);
-				_FAT_cache_writePartialSector (partition->cache, lfnEntry, _FAT_fat_clusterToSector(partition, curEntryPos.cluster) + curEntryPos.sector, curEntryPos.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+				_FAT_cache_writePartialSector (partition->metaCache, lfnEntry, _FAT_fat_clusterToSector(partition, curEntryPos.cluster) + curEntryPos.sector, curEntryPos.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 			} else {
 				// Alias & file data
-				_FAT_cache_writePartialSector (partition->cache, entry->entryData, _FAT_fat_clusterToSector(partition, curEntryPos.cluster) + curEntryPos.sector, curEntryPos.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
+				_FAT_cache_writePartialSector (partition->metaCache, entry->entryData, _FAT_fat_clusterToSector(partition, curEntryPos.cluster) + curEntryPos.sector, curEntryPos.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 			}
 		}
 	}
@@ -71,6 +71,62 @@ static inline bool _FAT_disc_writeSectors (const DISC_INTERFACE* disc, sec_t sec
 	return disc->writeSectors (sector, numSectors, buffer);
 }
 
+/*
+Return the queued transfer entry points of a disc, or NULL if it only
+supports blocking transfers
+*/
+static inline const DISC_INTERFACE_ASYNC* _FAT_disc_async (const DISC_INTERFACE* disc) {
+	if (!(disc->features & FEATURE_MEDIUM_ASYNC)) {
+		return NULL;
+	}
+	return (const DISC_INTERFACE_ASYNC*)disc;
+}
+
+/*
+Queue a read or write of numSectors sectors, with the same limits as the
+blocking calls. done(token, success) is called from _FAT_disc_wait or
+_FAT_disc_poll once it completes. Returns false if it could not be queued.
+*/
+static inline bool _FAT_disc_submitReadSectors (const DISC_INTERFACE_ASYNC* disc, sec_t sector, sec_t numSectors, void* buffer, FN_MEDIUM_COMPLETION done, void* token) {
+	return disc->submitRead (sector, numSectors, buffer, done, token);
+}
+
+static inline bool _FAT_disc_submitWriteSectors (const DISC_INTERFACE_ASYNC* disc, sec_t sector, sec_t numSectors, const void* buffer, FN_MEDIUM_COMPLETION done, void* token) {
+	return disc->submitWrite (sector, numSectors, buffer, done, token);
+}
+
+/*
+Complete whatever queued transfers have finished, without blocking
+*/
+static inline unsigned int _FAT_disc_poll (const DISC_INTERFACE_ASYNC* disc) {
+	return disc->poll();
+}
+
+/*
+Block until every queued transfer has completed
+*/
+static inline bool _FAT_disc_wait (const DISC_INTERFACE_ASYNC* disc) {
+	return disc->wait();
+}
+
+/*
+Return the direct access entry point of a disc held in memory, or NULL
+if its sectors can only be copied out with _FAT_disc_readSectors
+*/
+static inline const DISC_INTERFACE_MAPPED* _FAT_disc_mapped (const DISC_INTERFACE* disc) {
+	if (!(disc->features & FEATURE_MEDIUM_MAPPED)) {
+		return NULL;
+	}
+	return (const DISC_INTERFACE_MAPPED*)disc;
+}
+
+/*
+Return a pointer to numSectors sectors of a disc held in memory, or NULL
+*/
+static inline const void* _FAT_disc_mapSectors (const DISC_INTERFACE_MAPPED* disc, sec_t sector, sec_t numSectors) {
+	return disc->mapSectors (sector, numSectors);
+}
+
 /*
 Reset the card back to a ready state
 */
@@ -0,0 +1,712 @@
+/*
+ disc_image.c
+ Disc interfaces over a disc image file or block device on a Linux host.
+ fatImageDisc queues transfers through io_uring when the kernel allows it,
+ with blocking preadv/pwritev as the fallback. fatMappedImageDisc maps the
+ image into memory so the cache can read it in place.
+
+ Copyright (c) 2026 libfat contributors
+
+ Redistribution and use in source and binary forms, with or without modification,
+ are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice,
+     this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation and/or
+     other materials provided with the distribution.
+  3. The name of the author may not be used to endorse or promote products derived
+     from this software without specific prior written permission.
+
+ THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR IMPLIED
+ WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHOR BE
+ LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#if defined (__linux__) && !defined (_GNU_SOURCE)
+#define _GNU_SOURCE		// O_DIRECT
+#endif
+
+#include "common.h"
+
+#ifdef USE_IMAGE_DISC
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+
+#include "mem_allocate.h"
+
+#define IMAGE_SECTOR_SIZE		512			// Sector size seen by the file system
+#define IMAGE_DEFAULT_QUEUE		32
+#define IMAGE_MAX_QUEUE			256
+#define IMAGE_MAX_PATH			256
+
+// Open flags, must match FAT_IMAGE_* in fat.h
+#define IMAGE_READONLY			0x01
+#define IMAGE_DIRECT			0x02
+#define IMAGE_NO_URING			0x04
+#define IMAGE_SYNC_WRITES		0x08
+
+/*
+A queued transfer, indexed by the user_data of its submission
+*/
+typedef struct {
+	FN_MEDIUM_COMPLETION done;
+	void*                token;
+	bool                 write;
+	sec_t                sector;
+	sec_t                numSectors;
+	void*                buffer;
+} IMAGE_REQUEST;
+
+/*
+The io_uring submission and completion rings, mapped from the kernel
+*/
+typedef struct {
+	int                  fd;
+	unsigned int         entries;
+	unsigned int*        sqHead;
+	unsigned int*        sqTail;
+	unsigned int*        sqMask;
+	unsigned int*        sqArray;
+	struct io_uring_sqe* sqes;
+	unsigned int*        cqHead;
+	unsigned int*        cqTail;
+	unsigned int*        cqMask;
+	struct io_uring_cqe* cqes;
+	void*                sqRing;
+	size_t               sqRingSize;
+	void*                cqRing;
+	size_t               cqRingSize;
+	size_t               sqesSize;
+} IMAGE_RING;
+
+static struct {
+	char           path[IMAGE_MAX_PATH];
+	uint32_t       flags;
+	unsigned int   queueDepth;
+	int            fd;				// Opened with O_DIRECT if asked for
+	int            bufferedFd;		// Same image without O_DIRECT, for transfers it can't take
+	unsigned int   directAlign;		// Buffer, offset and length alignment O_DIRECT needs
+	IMAGE_RING     ring;
+	bool           useRing;
+	IMAGE_REQUEST* requests;
+	unsigned int*  freeRequests;	// Stack of unused request slots
+	unsigned int   numFree;
+	unsigned int   inFlight;
+	bool           failed;			// A queued transfer failed since the last wait
+} _FAT_image = {
+	"", 0, 0, -1, -1, 0,
+	{ -1, 0, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, 0, 0 },
+	false, NULL, NULL, 0, 0, false
+};
+
+static DISC_INTERFACE_ASYNC _FAT_image_interface;
+
+/*
+Blocking transfer of a whole request, retrying on short transfers and
+on the buffered descriptor when O_DIRECT refuses the alignment.
+*/
+static bool _FAT_image_transfer (bool write, sec_t sector, sec_t numSectors, void* buffer) {
+	uint8_t* data = (uint8_t*)buffer;
+	off_t offset = (off_t)sector * IMAGE_SECTOR_SIZE;
+	size_t remaining = (size_t)numSectors * IMAGE_SECTOR_SIZE;
+	int fd = _FAT_image.fd;
+	struct iovec iov;
+	ssize_t done;
+
+	if ((_FAT_image.bufferedFd >= 0) &&
+		((((uintptr_t)data | (uintptr_t)offset | remaining) & (_FAT_image.directAlign - 1)) != 0))
+	{
+		fd = _FAT_image.bufferedFd;
+	}
+
+	while (remaining > 0) {
+		iov.iov_base = data;
+		iov.iov_len = remaining;
+		done = write ? pwritev (fd, &iov, 1, offset) : preadv (fd, &iov, 1, offset);
+		if (done < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EINVAL) && (fd != _FAT_image.bufferedFd) && (_FAT_image.bufferedFd >= 0)) {
+				fd = _FAT_image.bufferedFd;
+				continue;
+			}
+			return false;
+		}
+		if (done == 0) {
+			// Past the end of the image
+			return false;
+		}
+		data += done;
+		offset += done;
+		remaining -= done;
+	}
+	return true;
+}
+
+static int _FAT_image_uringSetup (unsigned int entries, struct io_uring_params* params) {
+	return (int) syscall (__NR_io_uring_setup, entries, params);
+}
+
+static int _FAT_image_uringEnter (int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags) {
+	return (int) syscall (__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+static void _FAT_image_ringClose (void) {
+	IMAGE_RING* ring = &_FAT_image.ring;
+
+	if (ring->sqes) {
+		munmap (ring->sqes, ring->sqesSize);
+	}
+	if (ring->cqRing && (ring->cqRing != ring->sqRing)) {
+		munmap (ring->cqRing, ring->cqRingSize);
+	}
+	if (ring->sqRing) {
+		munmap (ring->sqRing, ring->sqRingSize);
+	}
+	if (ring->fd >= 0) {
+		close (ring->fd);
+	}
+	memset (ring, 0, sizeof(IMAGE_RING));
+	ring->fd = -1;
+}
+
+/*
+Set up an io_uring with room for entries transfers.
+Returns false if the kernel doesn't offer one, or refuses it.
+*/
+static bool _FAT_image_ringOpen (unsigned int entries) {
+	IMAGE_RING* ring = &_FAT_image.ring;
+	struct io_uring_params params;
+	uint8_t* sq;
+	uint8_t* cq;
+
+	memset (ring, 0, sizeof(IMAGE_RING));
+	memset (&params, 0, sizeof(params));
+	ring->fd = _FAT_image_uringSetup (entries, &params);
+	if (ring->fd < 0) {
+		ring->fd = -1;
+		return false;
+	}
+	ring->entries = params.sq_entries;
+
+	ring->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqRingSize > ring->sqRingSize) {
+			ring->sqRingSize = ring->cqRingSize;
+		}
+		ring->cqRingSize = ring->sqRingSize;
+	}
+
+	ring->sqRing = mmap (NULL, ring->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqRing == MAP_FAILED) {
+		ring->sqRing = NULL;
+		goto fail;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cqRing = ring->sqRing;
+	} else {
+		ring->cqRing = mmap (NULL, ring->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqRing == MAP_FAILED) {
+			ring->cqRing = NULL;
+			goto fail;
+		}
+	}
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = (struct io_uring_sqe*) mmap (NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto fail;
+	}
+
+	sq = (uint8_t*)ring->sqRing;
+	ring->sqHead = (unsigned int*)(sq + params.sq_off.head);
+	ring->sqTail = (unsigned int*)(sq + params.sq_off.tail);
+	ring->sqMask = (unsigned int*)(sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned int*)(sq + params.sq_off.array);
+	cq = (uint8_t*)ring->cqRing;
+	ring->cqHead = (unsigned int*)(cq + params.cq_off.head);
+	ring->cqTail = (unsigned int*)(cq + params.cq_off.tail);
+	ring->cqMask = (unsigned int*)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+	return true;
+
+fail:
+	_FAT_image_ringClose ();
+	return false;
+}
+
+static void _FAT_image_closeFiles (void) {
+	if (_FAT_image.bufferedFd >= 0) {
+		close (_FAT_image.bufferedFd);
+		_FAT_image.bufferedFd = -1;
+	}
+	if (_FAT_image.fd >= 0) {
+		close (_FAT_image.fd);
+		_FAT_image.fd = -1;
+	}
+}
+
+static bool _FAT_image_startup (void) {
+	int openFlags;
+	unsigned int i;
+	int sectorSize;
+	struct stat st;
+
+	if (_FAT_image.fd >= 0) {
+		return true;
+	}
+	if (_FAT_image.path[0] == '\0') {
+		return false;
+	}
+
+	openFlags = ((_FAT_image.flags & IMAGE_READONLY) ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+	_FAT_image.fd = open (_FAT_image.path, openFlags | ((_FAT_image.flags & IMAGE_DIRECT) ? O_DIRECT : 0));
+	if ((_FAT_image.fd < 0) && (_FAT_image.flags & IMAGE_DIRECT)) {
+		// Some file systems don't support O_DIRECT at all
+		_FAT_image.fd = open (_FAT_image.path, openFlags);
+	} else if (_FAT_image.flags & IMAGE_DIRECT) {
+		_FAT_image.bufferedFd = open (_FAT_image.path, openFlags);
+		_FAT_image.directAlign = IMAGE_SECTOR_SIZE;
+		if ((fstat (_FAT_image.fd, &st) == 0) && S_ISBLK(st.st_mode) &&
+			(ioctl (_FAT_image.fd, BLKSSZGET, &sectorSize) == 0) && (sectorSize > IMAGE_SECTOR_SIZE))
+		{
+			_FAT_image.directAlign = sectorSize;
+		}
+	}
+	if (_FAT_image.fd < 0) {
+		return false;
+	}
+
+	_FAT_image.useRing = false;
+	_FAT_image.inFlight = 0;
+	_FAT_image.failed = false;
+	_FAT_image_interface.base.features &= ~FEATURE_MEDIUM_ASYNC;
+	if (_FAT_image.flags & IMAGE_READONLY) {
+		_FAT_image_interface.base.features &= ~FEATURE_MEDIUM_CANWRITE;
+	} else {
+		_FAT_image_interface.base.features |= FEATURE_MEDIUM_CANWRITE;
+	}
+
+	// Only advertise queued transfers if the kernel gives us a ring
+	if (!(_FAT_image.flags & IMAGE_NO_URING) && _FAT_image_ringOpen (_FAT_image.queueDepth)) {
+		_FAT_image.requests = (IMAGE_REQUEST*) _FAT_mem_allocate (sizeof(IMAGE_REQUEST) * _FAT_image.ring.entries);
+		_FAT_image.freeRequests = (unsigned int*) _FAT_mem_allocate (sizeof(unsigned int) * _FAT_image.ring.entries);
+		if (_FAT_image.requests && _FAT_image.freeRequests) {
+			for (i = 0; i < _FAT_image.ring.entries; i++) {
+				_FAT_image.freeRequests[i] = i;
+			}
+			_FAT_image.numFree = _FAT_image.ring.entries;
+			_FAT_image.useRing = true;
+			_FAT_image_interface.base.features |= FEATURE_MEDIUM_ASYNC;
+		} else {
+			if (_FAT_image.requests) {
+				_FAT_mem_free (_FAT_image.requests);
+				_FAT_image.requests = NULL;
+			}
+			if (_FAT_image.freeRequests) {
+				_FAT_mem_free (_FAT_image.freeRequests);
+				_FAT_image.freeRequests = NULL;
+			}
+			_FAT_image_ringClose ();
+		}
+	}
+
+	return true;
+}
+
+static bool _FAT_image_isInserted (void) {
+	return _FAT_image.fd >= 0;
+}
+
+static bool _FAT_image_readSectors (sec_t sector, sec_t numSectors, void* buffer) {
+	return _FAT_image_transfer (false, sector, numSectors, buffer);
+}
+
+static bool _FAT_image_writeSectors (sec_t sector, sec_t numSectors, const void* buffer) {
+	if (_FAT_image.flags & IMAGE_READONLY) {
+		return false;
+	}
+	return _FAT_image_transfer (true, sector, numSectors, (void*)buffer);
+}
+
+static bool _FAT_image_clearStatus (void) {
+	return true;
+}
+
+/*
+Hand one transfer to the kernel. Transfers O_DIRECT can't take, because
+of their alignment, are refused so the caller uses the blocking path.
+*/
+static bool _FAT_image_submit (bool write, sec_t sector, sec_t numSectors, void* buffer, FN_MEDIUM_COMPLETION done, void* token) {
+	IMAGE_RING* ring = &_FAT_image.ring;
+	IMAGE_REQUEST* request;
+	struct io_uring_sqe* sqe;
+	unsigned int slot, tail, index;
+	uint64_t offset = (uint64_t)sector * IMAGE_SECTOR_SIZE;
+	size_t length = (size_t)numSectors * IMAGE_SECTOR_SIZE;
+
+	if (!_FAT_image.useRing || (_FAT_image.numFree == 0)) {
+		return false;
+	}
+	if ((_FAT_image.bufferedFd >= 0) &&
+		((((uintptr_t)buffer | offset | length) & (_FAT_image.directAlign - 1)) != 0))
+	{
+		return false;
+	}
+
+	slot = _FAT_image.freeRequests[--_FAT_image.numFree];
+	request = &_FAT_image.requests[slot];
+	request->done = done;
+	request->token = token;
+	request->write = write;
+	request->sector = sector;
+	request->numSectors = numSectors;
+	request->buffer = buffer;
+
+	tail = *ring->sqTail;
+	index = tail & *ring->sqMask;
+	sqe = &ring->sqes[index];
+	memset (sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = _FAT_image.fd;
+	sqe->off = offset;
+	sqe->addr = (uintptr_t)buffer;
+	sqe->len = length;
+	sqe->user_data = slot;
+	ring->sqArray[index] = index;
+	__atomic_store_n (ring->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	if (_FAT_image_uringEnter (ring->fd, 1, 0, 0) != 1) {
+		// Take the entry back, the kernel didn't consume it
+		__atomic_store_n (ring->sqTail, tail, __ATOMIC_RELEASE);
+		_FAT_image.freeRequests[_FAT_image.numFree++] = slot;
+		return false;
+	}
+	_FAT_image.inFlight++;
+	return true;
+}
+
+static bool _FAT_image_submitRead (sec_t sector, sec_t numSectors, void* buffer, FN_MEDIUM_COMPLETION done, void* token) {
+	return _FAT_image_submit (false, sector, numSectors, buffer, done, token);
+}
+
+static bool _FAT_image_submitWrite (sec_t sector, sec_t numSectors, const void* buffer, FN_MEDIUM_COMPLETION done, void* token) {
+	if (_FAT_image.flags & IMAGE_READONLY) {
+		return false;
+	}
+	return _FAT_image_submit (true, sector, numSectors, (void*)buffer, done, token);
+}
+
+/*
+Run the callbacks of every completed transfer. A transfer the kernel
+cut short is finished with a blocking call.
+*/
+static unsigned int _FAT_image_reap (void) {
+	IMAGE_RING* ring = &_FAT_image.ring;
+	IMAGE_REQUEST* request;
+	struct io_uring_cqe* cqe;
+	unsigned int head, reaped = 0;
+	FN_MEDIUM_COMPLETION done;
+	void* token;
+	size_t length;
+	bool success;
+	int res;
+
+	head = *ring->cqHead;
+	while (head != __atomic_load_n (ring->cqTail, __ATOMIC_ACQUIRE)) {
+		cqe = &ring->cqes[head & *ring->cqMask];
+		request = &_FAT_image.requests[cqe->user_data];
+		res = cqe->res;
+		head++;
+		__atomic_store_n (ring->cqHead, head, __ATOMIC_RELEASE);
+
+		length = (size_t)request->numSectors * IMAGE_SECTOR_SIZE;
+		if ((res >= 0) && ((size_t)res == length)) {
+			success = true;
+		} else if ((res >= 0) && ((res % IMAGE_SECTOR_SIZE) == 0) && (res > 0)) {
+			success = _FAT_image_transfer (request->write, request->sector + res / IMAGE_SECTOR_SIZE,
+				request->numSectors - res / IMAGE_SECTOR_SIZE, (uint8_t*)request->buffer + res);
+		} else {
+			// Let the blocking path have a go, it also retries without O_DIRECT
+			success = _FAT_image_transfer (request->write, request->sector, request->numSectors, request->buffer);
+		}
+		if (!success) {
+			_FAT_image.failed = true;
+		}
+
+		done = request->done;
+		token = request->token;
+		_FAT_image.freeRequests[_FAT_image.numFree++] = (unsigned int)(request - _FAT_image.requests);
+		_FAT_image.inFlight--;
+		reaped++;
+		done (token, success);
+	}
+	return reaped;
+}
+
+static unsigned int _FAT_image_poll (void) {
+	if (!_FAT_image.useRing) {
+		return 0;
+	}
+	return _FAT_image_reap ();
+}
+
+static bool _FAT_image_wait (void) {
+	bool ok;
+
+	if (!_FAT_image.useRing) {
+		return true;
+	}
+	while (_FAT_image.inFlight > 0) {
+		_FAT_image_reap ();
+		if (_FAT_image.inFlight == 0) {
+			break;
+		}
+		if ((_FAT_image_uringEnter (_FAT_image.ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) && (errno != EINTR)) {
+			return false;
+		}
+	}
+	ok = !_FAT_image.failed;
+	_FAT_image.failed = false;
+	return ok;
+}
+
+static bool _FAT_image_shutdown (void) {
+	bool ok = true;
+
+	if (_FAT_image.fd < 0) {
+		return true;
+	}
+	if (_FAT_image.useRing) {
+		ok = _FAT_image_wait ();
+		_FAT_image_ringClose ();
+		_FAT_mem_free (_FAT_image.requests);
+		_FAT_mem_free (_FAT_image.freeRequests);
+		_FAT_image.requests = NULL;
+		_FAT_image.freeRequests = NULL;
+		_FAT_image.useRing = false;
+	}
+	if (!(_FAT_image.flags & IMAGE_READONLY) && (fsync (_FAT_image.fd) != 0)) {
+		ok = false;
+	}
+	_FAT_image_closeFiles ();
+	return ok;
+}
+
+static DISC_INTERFACE_ASYNC _FAT_image_interface = {
+	{
+		0x474d4948, // ioType "HIMG"
+		FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE,
+		_FAT_image_startup,
+		_FAT_image_isInserted,
+		_FAT_image_readSectors,
+		_FAT_image_writeSectors,
+		_FAT_image_clearStatus,
+		_FAT_image_shutdown
+	},
+	_FAT_image_submitRead,
+	_FAT_image_submitWrite,
+	_FAT_image_poll,
+	_FAT_image_wait
+};
+
+const DISC_INTERFACE* fatImageDisc (const char* path, uint32_t flags, uint32_t queueDepth) {
+	if (!path || (strlen (path) >= IMAGE_MAX_PATH) || (_FAT_image.fd >= 0)) {
+		return NULL;
+	}
+
+	if (queueDepth == 0) {
+		queueDepth = IMAGE_DEFAULT_QUEUE;
+	} else if (queueDepth > IMAGE_MAX_QUEUE) {
+		queueDepth = IMAGE_MAX_QUEUE;
+	}
+
+	strcpy (_FAT_image.path, path);
+	_FAT_image.flags = flags;
+	_FAT_image.queueDepth = queueDepth;
+	_FAT_image.ring.fd = -1;
+	return &_FAT_image_interface.base;
+}
+
+/*
+The memory mapped image. Reads are served straight from the mapping,
+writes land in it and reach the image through msync.
+*/
+static struct {
+	char           path[IMAGE_MAX_PATH];
+	uint32_t       flags;
+	int            fd;
+	uint8_t*       map;
+	size_t         size;
+} _FAT_mapped = { "", 0, -1, NULL, 0 };
+
+static DISC_INTERFACE_MAPPED _FAT_mapped_interface;
+
+/*
+Return the mapped bytes of numSectors sectors from sector, or NULL if
+they run past the end of the image.
+*/
+static uint8_t* _FAT_mapped_range (sec_t sector, sec_t numSectors) {
+	uint64_t start = (uint64_t)sector * IMAGE_SECTOR_SIZE;
+	uint64_t length = (uint64_t)numSectors * IMAGE_SECTOR_SIZE;
+
+	if ((_FAT_mapped.map == NULL) || (start + length > _FAT_mapped.size)) {
+		return NULL;
+	}
+	return _FAT_mapped.map + start;
+}
+
+static bool _FAT_mapped_startup (void) {
+	bool readOnly = (_FAT_mapped.flags & IMAGE_READONLY) != 0;
+	struct stat st;
+	uint64_t size;
+	void* map;
+
+	if (_FAT_mapped.map != NULL) {
+		return true;
+	}
+	if (_FAT_mapped.path[0] == '\0') {
+		return false;
+	}
+
+	_FAT_mapped.fd = open (_FAT_mapped.path, (readOnly ? O_RDONLY : O_RDWR) | O_CLOEXEC);
+	if (_FAT_mapped.fd < 0) {
+		return false;
+	}
+	if (fstat (_FAT_mapped.fd, &st) != 0) {
+		goto fail;
+	}
+	size = st.st_size;
+	if (S_ISBLK(st.st_mode) && (ioctl (_FAT_mapped.fd, BLKGETSIZE64, &size) != 0)) {
+		goto fail;
+	}
+	if (size < IMAGE_SECTOR_SIZE) {
+		goto fail;
+	}
+
+	map = mmap (NULL, size, readOnly ? PROT_READ : (PROT_READ | PROT_WRITE), MAP_SHARED, _FAT_mapped.fd, 0);
+	if (map == MAP_FAILED) {
+		goto fail;
+	}
+	_FAT_mapped.map = (uint8_t*)map;
+	_FAT_mapped.size = size;
+
+	if (readOnly) {
+		_FAT_mapped_interface.base.features &= ~FEATURE_MEDIUM_CANWRITE;
+	} else {
+		_FAT_mapped_interface.base.features |= FEATURE_MEDIUM_CANWRITE;
+	}
+	return true;
+
+fail:
+	close (_FAT_mapped.fd);
+	_FAT_mapped.fd = -1;
+	return false;
+}
+
+static bool _FAT_mapped_isInserted (void) {
+	return _FAT_mapped.map != NULL;
+}
+
+static bool _FAT_mapped_readSectors (sec_t sector, sec_t numSectors, void* buffer) {
+	const uint8_t* data = _FAT_mapped_range (sector, numSectors);
+
+	if (data == NULL) {
+		return false;
+	}
+	memcpy (buffer, data, (size_t)numSectors * IMAGE_SECTOR_SIZE);
+	return true;
+}
+
+static bool _FAT_mapped_writeSectors (sec_t sector, sec_t numSectors, const void* buffer) {
+	uint8_t* data = _FAT_mapped_range (sector, numSectors);
+	size_t length = (size_t)numSectors * IMAGE_SECTOR_SIZE;
+	uintptr_t pageMask = (uintptr_t)sysconf (_SC_PAGESIZE) - 1;
+	uint8_t* syncStart;
+
+	if ((data == NULL) || (_FAT_mapped.flags & IMAGE_READONLY)) {
+		return false;
+	}
+	memcpy (data, buffer, length);
+
+	if (_FAT_mapped.flags & IMAGE_SYNC_WRITES) {
+		// msync wants a page aligned start
+		syncStart = (uint8_t*)((uintptr_t)data & ~pageMask);
+		return msync (syncStart, (data + length) - syncStart, MS_SYNC) == 0;
+	}
+	return true;
+}
+
+/*
+Push everything written so far out to the image
+*/
+static bool _FAT_mapped_clearStatus (void) {
+	if ((_FAT_mapped.map == NULL) || (_FAT_mapped.flags & IMAGE_READONLY)) {
+		return true;
+	}
+	return msync (_FAT_mapped.map, _FAT_mapped.size, MS_SYNC) == 0;
+}
+
+static bool _FAT_mapped_shutdown (void) {
+	bool ok;
+
+	if (_FAT_mapped.map == NULL) {
+		return true;
+	}
+	ok = _FAT_mapped_clearStatus ();
+	munmap (_FAT_mapped.map, _FAT_mapped.size);
+	close (_FAT_mapped.fd);
+	_FAT_mapped.map = NULL;
+	_FAT_mapped.size = 0;
+	_FAT_mapped.fd = -1;
+	return ok;
+}
+
+static const void* _FAT_mapped_mapSectors (sec_t sector, sec_t numSectors) {
+	return _FAT_mapped_range (sector, numSectors);
+}
+
+static DISC_INTERFACE_MAPPED _FAT_mapped_interface = {
+	{
+		0x504d4948, // ioType "HIMP"
+		FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE | FEATURE_MEDIUM_MAPPED,
+		_FAT_mapped_startup,
+		_FAT_mapped_isInserted,
+		_FAT_mapped_readSectors,
+		_FAT_mapped_writeSectors,
+		_FAT_mapped_clearStatus,
+		_FAT_mapped_shutdown
+	},
+	_FAT_mapped_mapSectors
+};
+
+const DISC_INTERFACE* fatMappedImageDisc (const char* path, uint32_t flags) {
+	if (!path || (strlen (path) >= IMAGE_MAX_PATH) || (_FAT_mapped.map != NULL)) {
+		return NULL;
+	}
+
+	strcpy (_FAT_mapped.path, path);
+	_FAT_mapped.flags = flags;
+	return &_FAT_mapped_interface.base;
+}
+
+#endif // USE_IMAGE_DISC
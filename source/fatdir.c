@@ -202,7 +202,7 @@ static int _FAT_unlinkCommon (struct _reent *r, const char *path, bool isRmDir)
 	}
 
 	// Flush any sectors in the disc cache
-	if (!_FAT_cache_flush(partition->cache)) {
+	if (!_FAT_partition_flushCaches (partition)) {
 		r->_errno = EIO;
 		errorOccured = true;
 	}
@@ -357,7 +357,7 @@ int _FAT_rename_r (struct _reent *r, const char *oldName, const char *newName) {
 	}
 
 	// Flush any sectors in the disc cache
-	if (!_FAT_cache_flush (partition->cache)) {
+	if (!_FAT_partition_flushCaches (partition)) {
 		_FAT_unlock(&partition->lock);
 		r->_errno = EIO;
 		return -1;
@@ -470,7 +470,7 @@ int _FAT_mkdir_r (struct _reent *r, const char *path, int mode) {
 	u16_to_u8array (newEntryData, DIR_ENTRY_clusterHigh, dirCluster >> 16);
 
 	// Write it to the directory, erasing that sector in the process
-	_FAT_cache_eraseWritePartialSector ( partition->cache, newEntryData,
+	_FAT_cache_eraseWritePartialSector ( partition->metaCache, newEntryData,
 		_FAT_fat_clusterToSector (partition, dirCluster), 0, DIR_ENTRY_DATA_SIZE);
 
 
@@ -485,11 +485,11 @@ int _FAT_mkdir_r (struct _reent *r, const char *path, int mode) {
 	u16_to_u8array (newEntryData, DIR_ENTRY_clusterHigh, parentCluster >> 16);
 
 	// Write it to the directory
-	_FAT_cache_writePartialSector ( partition->cache, newEntryData,
+	_FAT_cache_writePartialSector ( partition->metaCache, newEntryData,
 		_FAT_fat_clusterToSector (partition, dirCluster), DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 
 	// Flush any sectors in the disc cache
-	if (!_FAT_cache_flush(partition->cache)) {
+	if (!_FAT_partition_flushCaches (partition)) {
 		_FAT_unlock(&partition->lock);
 		r->_errno = EIO;
 		return -1;
@@ -44,6 +44,8 @@
 #include "bit_ops.h"
 #include "filetime.h"
 #include "lock.h"
+#include "mem_allocate.h"
+#include "fatcachestats.h"
 
 bool _FAT_findEntry(const char *path, DIR_ENTRY *dirEntry) {
 	bool r;
@@ -110,7 +112,7 @@ int FAT_setAttr(const char *file, uint8_t attr) {
 
 	// Write Data
 	_FAT_cache_writePartialSector (
-		partition->cache // Cache to write
+		partition->metaCache // Cache to write
 		, &attr // Value to be written
 		, _FAT_fat_clusterToSector( partition , entryEnd.cluster ) + entryEnd.sector // cluster
 		, entryEnd.offset * DIR_ENTRY_DATA_SIZE + DIR_ENTRY_attributes // offset
@@ -118,7 +120,7 @@ int FAT_setAttr(const char *file, uint8_t attr) {
 	);
 
 	// Flush any sectors in the disc cache
-	if ( !_FAT_cache_flush( partition->cache ) ) {
+	if ( !_FAT_partition_flushCaches (partition) ) {
 		_FAT_unlock(&partition->lock); // Unlock Partition
 		return -1;
 	}
@@ -296,6 +298,14 @@ int _FAT_open_r (struct _reent *r, void *fileStruct, const char *path, int flags
 	file->rwPosition.sector =  0;
 	file->rwPosition.byte = 0;
 
+	file->readAhead.nextPosition = 0;
+	file->readAhead.window = 0;
+	file->preallocated = false;
+	file->extents = NULL;
+	file->extentCapacity = 0;
+	file->extentCount = 0;
+	file->extentClusters = 0;
+
 	if (flags & O_APPEND) {
 		file->append = true;
 
@@ -348,7 +358,7 @@ int _FAT_syncToDisc (FILE_STRUCT* file) {
 
 	if (file->write && file->modified) {
 		// Load the old entry
-		_FAT_cache_readPartialSector (file->partition->cache, dirEntryData,
+		_FAT_cache_readPartialSector (file->partition->metaCache, dirEntryData,
 			_FAT_fat_clusterToSector(file->partition, file->dirEntryEnd.cluster) + file->dirEntryEnd.sector,
 			file->dirEntryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 
@@ -371,12 +381,12 @@ int _FAT_syncToDisc (FILE_STRUCT* file) {
 		dirEntryData[DIR_ENTRY_attributes] |= ATTRIB_ARCH;
 
 		// Write the new entry
-		_FAT_cache_writePartialSector (file->partition->cache, dirEntryData,
+		_FAT_cache_writePartialSector (file->partition->metaCache, dirEntryData,
 			_FAT_fat_clusterToSector(file->partition, file->dirEntryEnd.cluster) + file->dirEntryEnd.sector,
 			file->dirEntryEnd.offset * DIR_ENTRY_DATA_SIZE, DIR_ENTRY_DATA_SIZE);
 
 		// Flush any sectors in the disc cache
-		if (!_FAT_cache_flush(file->partition->cache)) {
+		if (!_FAT_partition_flushCaches (file->partition)) {
 			return EIO;
 		}
 	}
@@ -399,6 +409,7 @@ int _FAT_close_r (struct _reent *r, void *fd) {
 	_FAT_lock(&file->partition->lock);
 
 	if (file->write) {
+		_FAT_file_releasePreallocation (file);
 		ret = _FAT_syncToDisc (file);
 		if (ret != 0) {
 			r->_errno = ret;
@@ -406,6 +417,7 @@ int _FAT_close_r (struct _reent *r, void *fd) {
 		}
 	}
 
+	_FAT_file_freeExtents (file);
 	file->inUse = false;
 
 	// Remove this file from the double-linked list of open files
@@ -424,6 +436,250 @@ int _FAT_close_r (struct _reent *r, void *fd) {
 	return ret;
 }
 
+/*
+Make room for one more run in the file's extent map.
+Returns false if the map is as big as it is allowed to get, or there isn't the memory.
+*/
+static bool _FAT_file_growExtents (FILE_STRUCT* file) {
+	FILE_EXTENT* extents;
+	uint32_t capacity;
+
+	if (file->extentCount < file->extentCapacity) {
+		return true;
+	}
+
+	capacity = (file->extentCapacity > 0) ? file->extentCapacity * 2 : 16;
+	if (capacity > DEFAULT_FILE_EXTENTS) {
+		capacity = DEFAULT_FILE_EXTENTS;
+	}
+	if (capacity <= file->extentCount) {
+		return false;
+	}
+
+	extents = (FILE_EXTENT*) _FAT_mem_allocate (capacity * sizeof(FILE_EXTENT));
+	if (extents == NULL) {
+		return false;
+	}
+	if (file->extents) {
+		memcpy (extents, file->extents, file->extentCount * sizeof(FILE_EXTENT));
+		_FAT_mem_free (file->extents);
+	}
+	file->extents = extents;
+	file->extentCapacity = capacity;
+	return true;
+}
+
+/*
+Forget the extent map, after the cluster chain has been cut short or replaced.
+The memory is kept for rebuilding it.
+*/
+static inline void _FAT_file_resetExtents (FILE_STRUCT* file) {
+	file->extentCount = 0;
+	file->extentClusters = 0;
+}
+
+void _FAT_file_freeExtents (FILE_STRUCT* file) {
+	_FAT_mem_free (file->extents);
+	file->extents = NULL;
+	file->extentCapacity = 0;
+	_FAT_file_resetExtents (file);
+}
+
+/*
+Follow the cluster chain on from the end of the extent map until the map covers
+the cluster at index lastIndex of the file, the chain ends or the map is full.
+Clusters added to the end of the chain are picked up by the next call.
+*/
+static void _FAT_file_mapExtents (FILE_STRUCT* file, uint32_t lastIndex) {
+	PARTITION* partition = file->partition;
+	FILE_EXTENT* extent;
+	uint32_t cluster, nextCluster;
+
+	while (file->extentClusters <= lastIndex) {
+		if (file->extentCount == 0) {
+			nextCluster = file->startCluster;
+		} else {
+			extent = &file->extents[file->extentCount - 1];
+			cluster = extent->cluster + extent->length - 1;
+			nextCluster = _FAT_fat_nextCluster (partition, cluster);
+			if ((nextCluster == cluster + 1) && _FAT_fat_isValidCluster (partition, nextCluster)) {
+				extent->length++;
+				file->extentClusters++;
+				continue;
+			}
+		}
+
+		if (!_FAT_fat_isValidCluster (partition, nextCluster) || !_FAT_file_growExtents (file)) {
+			break;
+		}
+		extent = &file->extents[file->extentCount++];
+		extent->fileCluster = file->extentClusters;
+		extent->cluster = nextCluster;
+		extent->length = 1;
+		file->extentClusters++;
+	}
+}
+
+/*
+Binary search the extent map for the run holding the cluster at index of the file.
+Returns NULL if the map doesn't reach that far.
+*/
+static FILE_EXTENT* _FAT_file_findExtent (FILE_STRUCT* file, uint32_t index) {
+	uint32_t low = 0, high = file->extentCount, mid;
+
+	if (index >= file->extentClusters) {
+		return NULL;
+	}
+
+	while (high - low > 1) {
+		mid = low + (high - low) / 2;
+		if (file->extents[mid].fileCluster <= index) {
+			low = mid;
+		} else {
+			high = mid;
+		}
+	}
+	return &file->extents[low];
+}
+
+/*
+Return the cluster at index of the file, or CLUSTER_EOF or CLUSTER_FREE if the chain is shorter.
+If the extent map can't reach it, the chain is followed from the end of the map, or from
+fromCluster at fromIndex if that is nearer. Pass CLUSTER_FREE if there is no such position.
+*/
+static uint32_t _FAT_file_clusterAt (FILE_STRUCT* file, uint32_t index, uint32_t fromIndex, uint32_t fromCluster) {
+	PARTITION* partition = file->partition;
+	FILE_EXTENT* extent;
+	uint32_t cluster;
+
+	_FAT_file_mapExtents (file, index);
+	extent = _FAT_file_findExtent (file, index);
+	if (extent) {
+		return extent->cluster + (index - extent->fileCluster);
+	}
+
+	if (!_FAT_fat_isValidCluster (partition, fromCluster) || (fromIndex > index) ||
+		((file->extentCount > 0) && (fromIndex < file->extentClusters - 1)))
+	{
+		if (file->extentCount > 0) {
+			extent = &file->extents[file->extentCount - 1];
+			fromIndex = file->extentClusters - 1;
+			fromCluster = extent->cluster + extent->length - 1;
+		} else {
+			fromIndex = 0;
+			fromCluster = file->startCluster;
+		}
+	}
+
+	cluster = fromCluster;
+	while ((fromIndex < index) && _FAT_fat_isValidCluster (partition, cluster)) {
+		cluster = _FAT_fat_nextCluster (partition, cluster);
+		fromIndex++;
+	}
+	return cluster;
+}
+
+/*
+Point the read/write position at position, which must be inside the file or at its end.
+If the end is on a cluster boundary, the position is left at the end of the last cluster
+so that the next write links on a new one. Returns false if the chain is too short.
+*/
+static bool _FAT_file_setPosition (FILE_STRUCT* file, uint32_t position) {
+	PARTITION* partition = file->partition;
+	uint32_t index = position / partition->bytesPerCluster;
+	uint32_t cluster;
+
+	file->rwPosition.sector = (position % partition->bytesPerCluster) / partition->bytesPerSector;
+	file->rwPosition.byte = position % partition->bytesPerSector;
+
+	cluster = _FAT_file_clusterAt (file, index, CLUSTER_FREE, CLUSTER_FREE);
+	if (!_FAT_fat_isValidCluster (partition, cluster) && (index > 0) &&
+		(file->rwPosition.sector == 0) && (file->rwPosition.byte == 0))
+	{
+		cluster = _FAT_file_clusterAt (file, index - 1, CLUSTER_FREE, CLUSTER_FREE);
+		file->rwPosition.sector = partition->sectorsPerCluster;
+	}
+	if (!_FAT_fat_isValidCluster (partition, cluster)) {
+		return false;
+	}
+
+	file->rwPosition.cluster = cluster;
+	return true;
+}
+
+/*
+Return how many of the file's clusters, starting with cluster at index, follow each other
+on disc, up to wanted. Always at least 1. Used to move whole runs in a single transfer.
+*/
+static uint32_t _FAT_file_contiguousClusters (FILE_STRUCT* file, uint32_t index, uint32_t cluster, uint32_t wanted) {
+	PARTITION* partition = file->partition;
+	FILE_EXTENT* extent;
+	uint32_t run;
+
+#ifdef LIMIT_SECTORS
+	if (wanted > LIMIT_SECTORS / partition->sectorsPerCluster) {
+		wanted = LIMIT_SECTORS / partition->sectorsPerCluster;
+	}
+#endif
+	if (wanted <= 1) {
+		return 1;
+	}
+
+	_FAT_file_mapExtents (file, index + wanted - 1);
+	extent = _FAT_file_findExtent (file, index);
+	if (extent && (extent->cluster + (index - extent->fileCluster) == cluster)) {
+		run = extent->length - (index - extent->fileCluster);
+	} else {
+		// Past the end of a full map, so follow the chain
+		for (run = 1; (run < wanted) && (_FAT_fat_nextCluster (partition, cluster + run - 1) == cluster + run); run++);
+	}
+
+	return (run < wanted) ? run : wanted;
+}
+
+/*
+Prefetch the part of the file that follows a sequential read of len bytes
+from startPosition. Only the contiguous part of the cluster chain is read
+ahead, and reads at least as large as the window are left alone since the
+cache passes them straight through to the disc.
+Does no locking of its own -- lock the partition before calling.
+*/
+static void _FAT_file_readAhead (FILE_STRUCT* file, uint32_t startPosition, size_t len) {
+	PARTITION* partition = file->partition;
+	CACHE* cache = partition->cache;
+	FILE_POSITION position = file->rwPosition;
+	unsigned int pages;
+	sec_t numSectors, fileSectors;
+	uint32_t nextCluster;
+
+	pages = _FAT_cache_readAheadWindow (cache, &file->readAhead, startPosition, len);
+	if (pages == 0 || file->currentPosition >= file->filesize) {
+		return;
+	}
+
+	numSectors = pages * cache->sectorsPerPage;
+	if (len >= numSectors * partition->bytesPerSector) {
+		return;
+	}
+
+	fileSectors = (file->filesize - file->currentPosition + position.byte + partition->bytesPerSector - 1) / partition->bytesPerSector;
+	if (numSectors > fileSectors) {
+		numSectors = fileSectors;
+	}
+
+	if (position.sector >= partition->sectorsPerCluster) {
+		nextCluster = _FAT_fat_nextCluster (partition, position.cluster);
+		if (!_FAT_fat_isValidCluster (partition, nextCluster)) {
+			return;
+		}
+		position.cluster = nextCluster;
+		position.sector = 0;
+	}
+
+	numSectors = _FAT_fat_contiguousSectors (partition, position.cluster, position.sector, numSectors);
+	_FAT_cache_prefetch (cache, _FAT_fat_clusterToSector (partition, position.cluster) + position.sector, numSectors);
+}
+
 ssize_t _FAT_read_r (struct _reent *r, void *fd, char *ptr, size_t len) {
 	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
 	PARTITION* partition;
@@ -522,21 +778,13 @@ ssize_t _FAT_read_r (struct _reent *r, void *fd, char *ptr, size_t len) {
 		}
 	}
 
-	// Read in whole clusters, contiguous blocks at a time
+	// Read in whole clusters, a run of contiguous ones at a time
 	while ((remain >= partition->bytesPerCluster) && flagNoError) {
-		uint32_t chunkEnd;
-		uint32_t nextChunkStart = position.cluster;
-		size_t chunkSize = 0;
-
-		do {
-			chunkEnd = nextChunkStart;
-			nextChunkStart = _FAT_fat_nextCluster (partition, chunkEnd);
-			chunkSize += partition->bytesPerCluster;
-		} while ((nextChunkStart == chunkEnd + 1) &&
-#ifdef LIMIT_SECTORS
-		 	(chunkSize + partition->bytesPerCluster <= LIMIT_SECTORS * partition->bytesPerSector) &&
-#endif
-			(chunkSize + partition->bytesPerCluster <= remain));
+		uint32_t chunkClusters = _FAT_file_contiguousClusters (file,
+			(file->currentPosition + (len - remain)) / partition->bytesPerCluster, position.cluster, remain / partition->bytesPerCluster);
+		uint32_t chunkEnd = position.cluster + chunkClusters - 1;
+		uint32_t nextChunkStart = _FAT_fat_nextCluster (partition, chunkEnd);
+		size_t chunkSize = (size_t)chunkClusters * partition->bytesPerCluster;
 
 		if (!_FAT_cache_readSectors (cache, _FAT_fat_clusterToSector (partition, position.cluster),
 				chunkSize / partition->bytesPerSector, ptr))
@@ -592,6 +840,10 @@ ssize_t _FAT_read_r (struct _reent *r, void *fd, char *ptr, size_t len) {
 	file->rwPosition = position;
 	file->currentPosition += len;
 
+	if (flagNoError) {
+		_FAT_file_readAhead (file, file->currentPosition - len, len);
+	}
+
 	_FAT_unlock(&partition->lock);
 	return len;
 }
@@ -616,8 +868,9 @@ static bool _FAT_check_position_for_next_cluster(struct _reent *r,
 		// need to advance to next cluster
 		tempNextCluster = _FAT_fat_nextCluster(partition, position->cluster);
 		if ((tempNextCluster == CLUSTER_EOF) || (tempNextCluster == CLUSTER_FREE)) {
-			// Ran out of clusters so get a new one
-			tempNextCluster = _FAT_fat_linkFreeCluster(partition, position->cluster);
+			// Ran out of clusters, so get enough for the rest of the write in as few runs as possible
+			tempNextCluster = _FAT_fat_allocateExtent(partition, position->cluster,
+				(remain + partition->bytesPerCluster - 1) / partition->bytesPerCluster, NULL);
 		}
 		if (!_FAT_fat_isValidCluster(partition, tempNextCluster)) {
 			// Couldn't get a cluster, so abort
@@ -633,6 +886,26 @@ err:
 	return false;
 }
 
+/*
+Return the cluster holding the last byte of the file, or its start cluster if it is empty.
+Clusters reserved by fatPreallocate may follow it in the chain.
+*/
+static uint32_t _FAT_file_endCluster (FILE_STRUCT* file) {
+	PARTITION* partition = file->partition;
+	uint32_t cluster = file->startCluster;
+	uint32_t links;
+
+	if (!file->preallocated) {
+		return _FAT_fat_lastCluster (partition, cluster);
+	}
+
+	links = (file->filesize > 0) ? (file->filesize - 1) / partition->bytesPerCluster : 0;
+	while (links-- > 0) {
+		cluster = _FAT_fat_nextCluster (partition, cluster);
+	}
+	return cluster;
+}
+
 /*
 Extend a file so that the size is the same as the rwPosition
 */
@@ -650,7 +923,7 @@ static bool _FAT_file_extend_r (struct _reent *r, FILE_STRUCT* file) {
 	position.sector = (file->filesize % partition->bytesPerCluster) / partition->bytesPerSector;
 	// It is assumed that there is always a startCluster
 	// This will be true when _FAT_file_extend_r is called from _FAT_write_r
-	position.cluster = _FAT_fat_lastCluster (partition, file->startCluster);
+	position.cluster = _FAT_file_endCluster (file);
 
 	remain = file->currentPosition - file->filesize;
 
@@ -718,6 +991,39 @@ static bool _FAT_file_extend_r (struct _reent *r, FILE_STRUCT* file) {
 	return true;
 }
 
+/*
+Give back the clusters a failed write linked on past the end of the file,
+and move the read/write and append positions off any that were freed
+*/
+static void _FAT_file_trimToSize (FILE_STRUCT* file) {
+	PARTITION* partition = file->partition;
+	FILE_POSITION rwPosition;
+
+	_FAT_file_resetExtents (file);
+
+	if (file->filesize == 0) {
+		_FAT_fat_clearLinks (partition, file->startCluster);
+		file->startCluster = CLUSTER_FREE;
+
+		file->rwPosition.cluster = CLUSTER_FREE;
+		file->rwPosition.sector = 0;
+		file->rwPosition.byte = 0;
+		file->appendPosition = file->rwPosition;
+		return;
+	}
+
+	_FAT_fat_trimChain (partition, file->startCluster, ((file->filesize - 1) / partition->bytesPerCluster) + 1);
+
+	if (file->append) {
+		rwPosition = file->rwPosition;
+		_FAT_file_setPosition (file, file->filesize);
+		file->appendPosition = file->rwPosition;
+		file->rwPosition = rwPosition;
+	} else {
+		_FAT_file_setPosition (file, file->currentPosition);
+	}
+}
+
 ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
 	PARTITION* partition;
@@ -726,6 +1032,7 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 	uint32_t tempNextCluster;
 	unsigned int tempVar;
 	size_t remain;
+	uint32_t writeStart;
 	bool flagNoError = true;
 	bool flagAppending = false;
 
@@ -754,7 +1061,8 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 
 	// Get a new cluster for the start of the file if required
 	if (file->startCluster == CLUSTER_FREE) {
-		tempNextCluster = _FAT_fat_linkFreeCluster (partition, CLUSTER_FREE);
+		tempNextCluster = _FAT_fat_allocateExtent (partition, CLUSTER_FREE,
+			(len + partition->bytesPerCluster - 1) / partition->bytesPerCluster, NULL);
 		if (!_FAT_fat_isValidCluster(partition, tempNextCluster)) {
 			// Couldn't get a cluster, so abort immediately
 			_FAT_unlock(&partition->lock);
@@ -775,6 +1083,7 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 
 	if (file->append) {
 		position = file->appendPosition;
+		writeStart = file->filesize;
 		flagAppending = true;
 	} else {
 		// If the write pointer is past the end of the file, extend the file to that size
@@ -787,6 +1096,7 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 
 		// Write at current read pointer
 		position = file->rwPosition;
+		writeStart = file->currentPosition;
 
 		// If it is writing past the current end of file, set appending flag
 		if (len + file->currentPosition > file->filesize) {
@@ -846,30 +1156,11 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 		// allocate next cluster
 		_FAT_check_position_for_next_cluster(r, &position, partition, remain, &flagNoError);
 		if (!flagNoError) break;
-		// set indexes to the current position
-		uint32_t chunkEnd = position.cluster;
-		uint32_t nextChunkStart = position.cluster;
-		size_t chunkSize = partition->bytesPerCluster;
-		FILE_POSITION next_position = position;
-
-		// group consecutive clusters
-		while (flagNoError &&
-#ifdef LIMIT_SECTORS
-				(chunkSize + partition->bytesPerCluster <= LIMIT_SECTORS * partition->bytesPerSector) &&
-#endif
-				(chunkSize + partition->bytesPerCluster < remain))
-		{
-			// pretend to use up all sectors in next_position
-			next_position.sector = partition->sectorsPerCluster;
-			// get or allocate next cluster
-			_FAT_check_position_for_next_cluster(r, &next_position, partition,
-					remain - chunkSize, &flagNoError);
-			if (!flagNoError) break; // exit loop on error
-			nextChunkStart = next_position.cluster;
-			if (nextChunkStart != chunkEnd + 1) break; // exit loop if not consecutive
-			chunkEnd = nextChunkStart;
-			chunkSize += partition->bytesPerCluster;
-		}
+		// Write the run of contiguous clusters from here. Any allocated above are
+		// in the chain by now, so the extent map picks them up
+		uint32_t chunkClusters = _FAT_file_contiguousClusters (file,
+			(writeStart + (len - remain)) / partition->bytesPerCluster, position.cluster, remain / partition->bytesPerCluster);
+		size_t chunkSize = (size_t)chunkClusters * partition->bytesPerCluster;
 
 		if ( !_FAT_cache_writeSectors (cache,
 				_FAT_fat_clusterToSector(partition, position.cluster), chunkSize / partition->bytesPerSector, ptr))
@@ -881,15 +1172,9 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 		ptr += chunkSize;
 		remain -= chunkSize;
 
-		if ((chunkEnd != nextChunkStart) && _FAT_fat_isValidCluster(partition, nextChunkStart)) {
-			// new cluster is already allocated (because it was not consecutive)
-			position.cluster = nextChunkStart;
-			position.sector = 0;
-		} else {
-			// Allocate a new cluster when next writing the file
-			position.cluster = chunkEnd;
-			position.sector = partition->sectorsPerCluster;
-		}
+		// Move on to the next cluster, or allocate one, when next writing the file
+		position.cluster += chunkClusters - 1;
+		position.sector = partition->sectorsPerCluster;
 	}
 
 	// allocate next cluster if needed
@@ -940,6 +1225,12 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 			file->filesize = file->currentPosition;
 		}
 	}
+
+	// The rest of the write may have had its clusters linked on already.
+	// Clusters reserved by fatPreallocate are kept until the file is closed
+	if (!flagNoError && !file->preallocated) {
+		_FAT_file_trimToSize (file);
+	}
 	_FAT_unlock(&partition->lock);
 
 	return len;
@@ -949,8 +1240,8 @@ ssize_t _FAT_write_r (struct _reent *r, void *fd, const char *ptr, size_t len) {
 off_t _FAT_seek_r (struct _reent *r, void *fd, off_t pos, int dir) {
 	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
 	PARTITION* partition;
-	uint32_t cluster, nextCluster;
-	int clusCount;
+	uint32_t cluster;
+	uint32_t clusCount, currentCount;
 	off_t newPosition;
 	uint32_t position;
 
@@ -998,38 +1289,30 @@ off_t _FAT_seek_r (struct _reent *r, void *fd, off_t pos, int dir) {
 	// Only change the read/write position if it is within the bounds of the current filesize,
 	// or at the very edge of the file
 	if (position <= file->filesize && file->startCluster != CLUSTER_FREE) {
-		// Calculate where the correct cluster is
-		// how many clusters from start of file
+		// Look up the cluster in the extent map. If the map can't reach it, the chain is
+		// followed from the current cluster when that is on the way
 		clusCount = position / partition->bytesPerCluster;
-		cluster = file->startCluster;
-		if (position >= file->currentPosition) {
-			// start from current cluster
-			int currentCount = file->currentPosition / partition->bytesPerCluster;
-			if (file->rwPosition.sector == partition->sectorsPerCluster) {
-				currentCount--;
-			}
-			clusCount -= currentCount;
-			cluster = file->rwPosition.cluster;
+		currentCount = file->currentPosition / partition->bytesPerCluster;
+		if ((file->rwPosition.sector == partition->sectorsPerCluster) && (currentCount > 0)) {
+			currentCount--;
 		}
+		cluster = _FAT_file_clusterAt (file, clusCount, currentCount,
+			(file->currentPosition <= file->filesize) ? file->rwPosition.cluster : CLUSTER_FREE);
+
 		// Calculate the sector and byte of the current position,
 		// and store them
 		file->rwPosition.sector = (position % partition->bytesPerCluster) / partition->bytesPerSector;
 		file->rwPosition.byte = position % partition->bytesPerSector;
 
-		nextCluster = _FAT_fat_nextCluster (partition, cluster);
-		while ((clusCount > 0) && (nextCluster != CLUSTER_FREE) && (nextCluster != CLUSTER_EOF)) {
-			clusCount--;
-			cluster = nextCluster;
-			nextCluster = _FAT_fat_nextCluster (partition, cluster);
-		}
-
 		// Check if ran out of clusters and it needs to allocate a new one
-		if (clusCount > 0) {
-			if ((clusCount == 1) && (file->filesize == position) && (file->rwPosition.sector == 0)) {
+		if (!_FAT_fat_isValidCluster (partition, cluster)) {
+			if ((clusCount > 0) && (file->filesize == position) && (file->rwPosition.sector == 0)) {
 				// Set flag to allocate a new cluster
+				cluster = _FAT_file_clusterAt (file, clusCount - 1, CLUSTER_FREE, CLUSTER_FREE);
 				file->rwPosition.sector = partition->sectorsPerCluster;
 				file->rwPosition.byte = 0;
-			} else {
+			}
+			if (!_FAT_fat_isValidCluster (partition, cluster)) {
 				_FAT_unlock(&partition->lock);
 				r->_errno = EINVAL;
 				return -1;
@@ -1120,6 +1403,7 @@ int _FAT_ftruncate_r (struct _reent *r, void *fd, off_t len) {
 		// Expanding the file
 		FILE_POSITION savedPosition;
 		uint32_t savedOffset;
+		uint32_t oldSize = file->filesize;
 		// Get a new cluster for the start of the file if required
 		if (file->startCluster == CLUSTER_FREE) {
 			uint32_t tempNextCluster = _FAT_fat_linkFreeCluster (partition, CLUSTER_FREE);
@@ -1148,19 +1432,27 @@ int _FAT_ftruncate_r (struct _reent *r, void *fd, off_t len) {
 		if (file->append) {
 			file->appendPosition = file->rwPosition;
 		}
-		// Restore the old rwPointer;
+		// Restore the old rwPointer. If it was past the old end it was only parked there,
+		// so find where it really is now that the file reaches it
 		file->rwPosition = savedPosition;
 		file->currentPosition = savedOffset;
+		if ((ret == 0) && (savedOffset > oldSize) && (savedOffset <= newSize)) {
+			_FAT_file_setPosition (file, savedOffset);
+		}
 	} else if (newSize < file->filesize){
 		// Shrinking the file
 		if (len == 0) {
 			// Cutting the file down to nothing, clear all clusters used
 			_FAT_fat_clearLinks (partition, file->startCluster);
 			file->startCluster = CLUSTER_FREE;
+			file->preallocated = false;
+			_FAT_file_resetExtents (file);
 
 			file->appendPosition.cluster = CLUSTER_FREE;
 			file->appendPosition.sector = 0;
 			file->appendPosition.byte = 0;
+
+			file->rwPosition = file->appendPosition;
 		} else {
 			// Trimming the file down to the required size
 			unsigned int chainLength;
@@ -1171,6 +1463,14 @@ int _FAT_ftruncate_r (struct _reent *r, void *fd, off_t len) {
 			// then set a flag to allocate a cluster as needed
 			chainLength = ((newSize-1) / partition->bytesPerCluster) + 1;
 			lastCluster = _FAT_fat_trimChain (partition, file->startCluster, chainLength);
+			file->preallocated = false;
+			_FAT_file_resetExtents (file);
+
+			// A read/write pointer at or past the new end may have been in a dropped cluster,
+			// so park it at the new end
+			if (file->currentPosition >= newSize) {
+				_FAT_file_setPosition (file, newSize);
+			}
 
 			if (file->append) {
 				file->appendPosition.byte = newSize % partition->bytesPerSector;
@@ -1195,6 +1495,110 @@ int _FAT_ftruncate_r (struct _reent *r, void *fd, off_t len) {
 	return ret;
 }
 
+int fatPreallocate (void* fd, uint32_t length, uint32_t flags) {
+	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
+	PARTITION* partition;
+	uint32_t wantClusters, haveClusters, oldClusters;
+	uint32_t cluster, nextCluster;
+	bool contiguous = true;
+
+	if (!file || !file->inUse || !file->write) {
+		return EBADF;
+	}
+	if (flags & ~FAT_PREALLOC_CONTIGUOUS) {
+		return EINVAL;
+	}
+	if (length == 0) {
+		return 0;
+	}
+
+	partition = file->partition;
+	_FAT_lock(&partition->lock);
+
+	// Find the end of the chain, up to the clusters wanted
+	wantClusters = ((length - 1) / partition->bytesPerCluster) + 1;
+	haveClusters = 0;
+	cluster = CLUSTER_FREE;
+	nextCluster = file->startCluster;
+	while (_FAT_fat_isValidCluster (partition, nextCluster) && (haveClusters < wantClusters)) {
+		cluster = nextCluster;
+		haveClusters++;
+		nextCluster = _FAT_fat_nextCluster (partition, cluster);
+	}
+	oldClusters = haveClusters;
+
+	// The new clusters are linked on the end of the chain, but left out of the file size,
+	// so nothing is zero filled. Writes grow the file into them without allocating.
+	while (haveClusters < wantClusters) {
+		nextCluster = _FAT_fat_allocateExtent (partition, cluster, wantClusters - haveClusters, NULL);
+		if (!_FAT_fat_isValidCluster (partition, nextCluster)) {
+			break;
+		}
+		if (file->startCluster == CLUSTER_FREE) {
+			file->startCluster = nextCluster;
+			file->rwPosition.cluster = file->startCluster;
+			file->rwPosition.sector = 0;
+			file->rwPosition.byte = 0;
+			file->appendPosition = file->rwPosition;
+			file->modified = true;
+		}
+		while (_FAT_fat_isValidCluster (partition, nextCluster) && (haveClusters < wantClusters)) {
+			if ((haveClusters > oldClusters) && (nextCluster != cluster + 1)) {
+				contiguous = false;
+			}
+			cluster = nextCluster;
+			haveClusters++;
+			nextCluster = _FAT_fat_nextCluster (partition, cluster);
+		}
+	}
+
+	if ((haveClusters < wantClusters) || (!contiguous && (flags & FAT_PREALLOC_CONTIGUOUS))) {
+		// Give back everything this call took
+		_FAT_file_resetExtents (file);
+		if (oldClusters > 0) {
+			_FAT_fat_trimChain (partition, file->startCluster, oldClusters);
+		} else if (file->startCluster != CLUSTER_FREE) {
+			_FAT_fat_clearLinks (partition, file->startCluster);
+			file->startCluster = CLUSTER_FREE;
+			file->rwPosition.cluster = CLUSTER_FREE;
+			file->appendPosition.cluster = CLUSTER_FREE;
+		}
+		_FAT_unlock(&partition->lock);
+		return ENOSPC;
+	}
+
+	if (haveClusters > oldClusters) {
+		file->preallocated = true;
+	}
+
+	_FAT_unlock(&partition->lock);
+	return 0;
+}
+
+void _FAT_file_releasePreallocation (FILE_STRUCT* file) {
+	PARTITION* partition = file->partition;
+
+	if (!file->preallocated) {
+		return;
+	}
+	file->preallocated = false;
+	_FAT_file_resetExtents (file);
+
+	if (file->startCluster == CLUSTER_FREE) {
+		return;
+	}
+
+	if (file->filesize == 0) {
+		_FAT_fat_clearLinks (partition, file->startCluster);
+		file->startCluster = CLUSTER_FREE;
+		file->rwPosition.cluster = CLUSTER_FREE;
+		file->appendPosition.cluster = CLUSTER_FREE;
+		file->modified = true;
+	} else {
+		_FAT_fat_trimChain (partition, file->startCluster, ((file->filesize - 1) / partition->bytesPerCluster) + 1);
+	}
+}
+
 int _FAT_fsync_r (struct _reent *r, void *fd) {
 	FILE_STRUCT* file = (FILE_STRUCT*)  fd;
 	int ret = 0;
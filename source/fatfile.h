@@ -47,6 +47,13 @@ typedef struct {
 	s32   byte;
 } FILE_POSITION;
 
+// A run of clusters that follow each other on disc
+typedef struct {
+	uint32_t fileCluster;	// Position of the run's first cluster within the file, counted in clusters
+	uint32_t cluster;		// The run's first cluster
+	uint32_t length;		// Clusters in the run
+} FILE_EXTENT;
+
 struct _FILE_STRUCT;
 
 struct _FILE_STRUCT {
@@ -60,11 +67,17 @@ struct _FILE_STRUCT {
 	PARTITION*           partition;
 	struct _FILE_STRUCT* prevOpenFile;		// The previous entry in a double-linked list of open files
 	struct _FILE_STRUCT* nextOpenFile;		// The next entry in a double-linked list of open files
+	CACHE_READAHEAD      readAhead;			// Sequential read detection, in bytes of the file
 	bool                 read;
 	bool                 write;
 	bool                 append;
 	bool                 inUse;
 	bool                 modified;
+	bool                 preallocated;		// fatPreallocate may have linked clusters past the end of the file
+	FILE_EXTENT*         extents;			// The cluster chain as runs, in file order. Built as far as it is needed
+	uint32_t             extentCount;		// Runs in extents
+	uint32_t             extentCapacity;	// Runs there is room for in extents
+	uint32_t             extentClusters;	// Clusters covered by extents
 };
 
 typedef struct _FILE_STRUCT FILE_STRUCT;
@@ -100,4 +113,18 @@ Returns 0 on success, an error code on failure.
 */
 extern int _FAT_syncToDisc (FILE_STRUCT* file);
 
+/*
+Free the clusters reserved by fatPreallocate that the file hasn't grown into.
+Does no locking of its own -- lock the partition before calling.
+*/
+extern void _FAT_file_releasePreallocation (FILE_STRUCT* file);
+
+/*
+Free the file's extent map.
+Does no locking of its own -- lock the partition before calling.
+*/
+extern void _FAT_file_freeExtents (FILE_STRUCT* file);
+
+int fatPreallocate (void* fd, uint32_t length, uint32_t flags);
+
 #endif // _FATFILE_H
@@ -31,89 +31,221 @@
 #include "file_allocation_table.h"
 #include "partition.h"
 #include "mem_allocate.h"
+#include "bit_ops.h"
 ////#include <string.h>
 void* memset(void* ptr, int value, unsigned int num);
 
 /*
-Gets the cluster linked from input cluster
+Note that a sector of the active FAT has changed, so the mirror FATs need a copy of it
 */
-uint32_t _FAT_fat_nextCluster(PARTITION* partition, uint32_t cluster)
-{
-	uint32_t nextCluster = CLUSTER_FREE;
-	sec_t sector;
-	int offset;
+static inline void _FAT_fat_markMirrorDirty (PARTITION* partition, sec_t sector) {
+	uint32_t index = (uint32_t)(sector - partition->fat.fatStart);
+
+	if (partition->fat.mirrorCount == 0) {
+		return;
+	}
+
+	if (partition->fat.mirrorDirty) {
+		partition->fat.mirrorDirty[index >> 5] |= (1u << (index & 31));
+	}
+	if (partition->fat.mirrorDirtyFirst > partition->fat.mirrorDirtyLast) {
+		partition->fat.mirrorDirtyFirst = index;
+		partition->fat.mirrorDirtyLast = index;
+	} else if (index < partition->fat.mirrorDirtyFirst) {
+		partition->fat.mirrorDirtyFirst = index;
+	} else if (index > partition->fat.mirrorDirtyLast) {
+		partition->fat.mirrorDirtyLast = index;
+	}
+}
+
+/*
+Return a FAT sector for reading. The pointer borrowed from the cache is kept
+and reused for as long as the cache generation says it is still good, so
+following a chain within a sector costs no cache lookups or copies.
+*/
+static inline const uint8_t* _FAT_fat_readSector (PARTITION* partition, sec_t sector) {
+	FAT* fat = &partition->fat;
+
+	if ((fat->pinData == NULL) || (fat->pinSector != sector) ||
+		(fat->pinGeneration != _FAT_cache_generation (partition->metaCache)))
+	{
+		fat->pinData = (const uint8_t*) _FAT_cache_borrowSectors (partition->metaCache, sector, 1);
+		fat->pinSector = sector;
+		// Taken after borrowing, since that may itself bring in a page
+		fat->pinGeneration = _FAT_cache_generation (partition->metaCache);
+	}
+	return fat->pinData;
+}
+
+/*
+Return a FAT sector for changing in place, marked for writing back to disc and to the mirrors
+*/
+static inline uint8_t* _FAT_fat_modifySector (PARTITION* partition, sec_t sector) {
+	uint8_t* data = _FAT_cache_modifySector (partition->metaCache, sector);
+
+	if (data != NULL) {
+		_FAT_fat_markMirrorDirty (partition, sector);
+	}
+	return data;
+}
+
+/*-----------------------------------------------------------------
+Entry accessors for each FAT type. _FAT_fat_setAccessors picks one
+pair when the partition is mounted, so finding an entry is a shift
+and a mask rather than a switch, a division and a copy.
+-----------------------------------------------------------------*/
+static uint32_t _FAT_fat_nextCluster12 (PARTITION* partition, uint32_t cluster) {
+	unsigned int offset = cluster + (cluster >> 1);
+	sec_t sector = partition->fat.fatStart + (offset >> partition->fat.sectorShift);
+	const uint8_t* data;
+	uint32_t nextCluster;
 
 	if (cluster == CLUSTER_FREE) {
 		return CLUSTER_FREE;
 	}
 
-	switch (partition->filesysType)
-	{
-		case FS_UNKNOWN:
-			return CLUSTER_ERROR;
-			break;
+	offset &= partition->bytesPerSector - 1;
+	data = _FAT_fat_readSector (partition, sector);
+	if (data == NULL) {
+		return CLUSTER_FREE;
+	}
+	nextCluster = data[offset];
 
-		case FS_FAT12:
-		{
-			u32 nextCluster_h;
-			sector = partition->fat.fatStart + (((cluster * 3) / 2) / partition->bytesPerSector);
-			offset = ((cluster * 3) / 2) % partition->bytesPerSector;
+	// The entry may run on into the next sector
+	if (offset + 1 < partition->bytesPerSector) {
+		nextCluster |= data[offset + 1] << 8;
+	} else {
+		data = _FAT_fat_readSector (partition, sector + 1);
+		if (data == NULL) {
+			return CLUSTER_FREE;
+		}
+		nextCluster |= data[0] << 8;
+	}
 
+	if (cluster & 0x01) {
+		nextCluster = nextCluster >> 4;
+	} else {
+		nextCluster &= 0x0FFF;
+	}
 
-			_FAT_cache_readLittleEndianValue (partition->cache, &nextCluster, sector, offset, sizeof(u8));
+	return (nextCluster >= 0x0FF7) ? CLUSTER_EOF : nextCluster;
+}
 
-			offset++;
+static uint32_t _FAT_fat_nextCluster16 (PARTITION* partition, uint32_t cluster) {
+	const uint8_t* data;
+	uint32_t nextCluster;
 
-			if (offset >= partition->bytesPerSector) {
-				offset = 0;
-				sector++;
-			}
-			nextCluster_h = 0;
+	if (cluster == CLUSTER_FREE) {
+		return CLUSTER_FREE;
+	}
 
-			_FAT_cache_readLittleEndianValue (partition->cache, &nextCluster_h, sector, offset, sizeof(u8));
-			nextCluster |= (nextCluster_h << 8);
+	data = _FAT_fat_readSector (partition, partition->fat.fatStart + (cluster >> (partition->fat.sectorShift - 1)));
+	if (data == NULL) {
+		return CLUSTER_FREE;
+	}
+	nextCluster = u8array_to_u16 (data, (cluster << 1) & (partition->bytesPerSector - 1));
 
-			if (cluster & 0x01) {
-				nextCluster = nextCluster >> 4;
-			} else 	{
-				nextCluster &= 0x0FFF;
-			}
+	return (nextCluster >= 0xFFF7) ? CLUSTER_EOF : nextCluster;
+}
 
-			if (nextCluster >= 0x0FF7)
-			{
-				nextCluster = CLUSTER_EOF;
-			}
+static uint32_t _FAT_fat_nextCluster32 (PARTITION* partition, uint32_t cluster) {
+	const uint8_t* data;
+	uint32_t nextCluster;
 
-			break;
+	if (cluster == CLUSTER_FREE) {
+		return CLUSTER_FREE;
+	}
+
+	data = _FAT_fat_readSector (partition, partition->fat.fatStart + (cluster >> (partition->fat.sectorShift - 2)));
+	if (data == NULL) {
+		return CLUSTER_FREE;
+	}
+	nextCluster = u8array_to_u32 (data, (cluster << 2) & (partition->bytesPerSector - 1));
+
+	return (nextCluster >= 0x0FFFFFF7) ? CLUSTER_EOF : nextCluster;
+}
+
+static bool _FAT_fat_writeEntry12 (PARTITION* partition, uint32_t cluster, uint32_t value) {
+	unsigned int offset = cluster + (cluster >> 1);
+	sec_t sector = partition->fat.fatStart + (offset >> partition->fat.sectorShift);
+	uint8_t* data;
+
+	offset &= partition->bytesPerSector - 1;
+	data = _FAT_fat_modifySector (partition, sector);
+	if (data == NULL) {
+		return false;
+	}
+
+	// Odd entries start in the high nibble of their first byte, even ones end in the low nibble of their second
+	if (cluster & 0x01) {
+		data[offset] = (data[offset] & 0x0F) | ((value << 4) & 0xF0);
+		value = (value >> 4) & 0xFF;
+	} else {
+		data[offset] = value & 0xFF;
+		value = (value >> 8) & 0x0F;
+	}
+
+	offset++;
+	if (offset >= partition->bytesPerSector) {
+		offset = 0;
+		data = _FAT_fat_modifySector (partition, sector + 1);
+		if (data == NULL) {
+			return false;
 		}
-		case FS_FAT16:
-			sector = partition->fat.fatStart + ((cluster << 1) / partition->bytesPerSector);
-			offset = (cluster % (partition->bytesPerSector >> 1)) << 1;
+	}
 
-			_FAT_cache_readLittleEndianValue (partition->cache, &nextCluster, sector, offset, sizeof(u16));
+	if (cluster & 0x01) {
+		data[offset] = value;
+	} else {
+		data[offset] = (data[offset] & 0xF0) | value;
+	}
+	return true;
+}
 
-			if (nextCluster >= 0xFFF7) {
-				nextCluster = CLUSTER_EOF;
-			}
-			break;
+static bool _FAT_fat_writeEntry16 (PARTITION* partition, uint32_t cluster, uint32_t value) {
+	uint8_t* data = _FAT_fat_modifySector (partition, partition->fat.fatStart + (cluster >> (partition->fat.sectorShift - 1)));
 
-		case FS_FAT32:
-			sector = partition->fat.fatStart + ((cluster << 2) / partition->bytesPerSector);
-			offset = (cluster % (partition->bytesPerSector >> 2)) << 2;
+	if (data == NULL) {
+		return false;
+	}
+	u16_to_u8array (data, (cluster << 1) & (partition->bytesPerSector - 1), value);
+	return true;
+}
 
-			_FAT_cache_readLittleEndianValue (partition->cache, &nextCluster, sector, offset, sizeof(u32));
+static bool _FAT_fat_writeEntry32 (PARTITION* partition, uint32_t cluster, uint32_t value) {
+	uint8_t* data = _FAT_fat_modifySector (partition, partition->fat.fatStart + (cluster >> (partition->fat.sectorShift - 2)));
 
-			if (nextCluster >= 0x0FFFFFF7) {
-				nextCluster = CLUSTER_EOF;
-			}
-			break;
+	if (data == NULL) {
+		return false;
+	}
+	u32_to_u8array (data, (cluster << 2) & (partition->bytesPerSector - 1), value);
+	return true;
+}
 
+void _FAT_fat_setAccessors (PARTITION* partition) {
+	partition->fat.sectorShift = 0;
+	while ((1u << partition->fat.sectorShift) < partition->bytesPerSector) {
+		partition->fat.sectorShift++;
+	}
+	partition->fat.pinData = NULL;
+	partition->fat.pinSector = 0;
+	partition->fat.pinGeneration = 0;
+
+	switch (partition->filesysType) {
+		case FS_FAT12:
+			partition->fat.nextCluster = _FAT_fat_nextCluster12;
+			partition->fat.writeEntry = _FAT_fat_writeEntry12;
+			break;
+		case FS_FAT16:
+			partition->fat.nextCluster = _FAT_fat_nextCluster16;
+			partition->fat.writeEntry = _FAT_fat_writeEntry16;
+			break;
+		case FS_FAT32:
 		default:
-			return CLUSTER_ERROR;
+			partition->fat.nextCluster = _FAT_fat_nextCluster32;
+			partition->fat.writeEntry = _FAT_fat_writeEntry32;
 			break;
 	}
-
-	return nextCluster;
 }
 
 /*
@@ -121,84 +253,525 @@ writes value into the correct offset within a partition's FAT, based
 on the cluster number.
 */
 static bool _FAT_fat_writeFatEntry (PARTITION* partition, uint32_t cluster, uint32_t value) {
-	sec_t sector;
-	int offset;
-	uint32_t oldValue;
-
 	if ((cluster < CLUSTER_FIRST) || (cluster > partition->fat.lastCluster /* This will catch CLUSTER_ERROR */))
 	{
 		return false;
 	}
 
-	switch (partition->filesysType)
-	{
-		case FS_UNKNOWN:
-			return false;
-			break;
+	if (!partition->fat.writeEntry (partition, cluster, value)) {
+		return false;
+	}
 
-		case FS_FAT12:
-			sector = partition->fat.fatStart + (((cluster * 3) / 2) / partition->bytesPerSector);
-			offset = ((cluster * 3) / 2) % partition->bytesPerSector;
+	if (partition->fat.freeMap) {
+		if (value == CLUSTER_FREE) {
+			partition->fat.freeMap[cluster >> 5] |= (1u << (cluster & 31));
+		} else {
+			partition->fat.freeMap[cluster >> 5] &= ~(1u << (cluster & 31));
+		}
+	}
+
+	return true;
+}
+
+/*-----------------------------------------------------------------
+Free entry masks for a group of 32 FAT entries: bit n is set if entry n
+is free. Zero reads the same in either byte order, so none of these
+care about the host's endianness. x86 and ARM builds use whatever vector
+instructions the compiler targets, everything else the scalar versions.
+-----------------------------------------------------------------*/
+#define FAT_SCAN_GROUP		32		// Entries per mask
+#define FAT_SCAN_SECTORS	32		// FAT sectors read at a time
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+
+static inline uint32_t _FAT_fat_freeMask16 (const uint8_t* entries) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i a = _mm256_cmpeq_epi16 (_mm256_loadu_si256 ((const __m256i*)entries), zero);
+	__m256i b = _mm256_cmpeq_epi16 (_mm256_loadu_si256 ((const __m256i*)(entries + 32)), zero);
+	// Packing works within each 128 bit lane, so put the quarters back in entry order
+	__m256i packed = _mm256_permute4x64_epi64 (_mm256_packs_epi16 (a, b), 0xD8);
+	return (uint32_t)_mm256_movemask_epi8 (packed);
+}
 
-			if (cluster & 0x01) {
+static inline uint32_t _FAT_fat_freeMask32 (const uint8_t* entries) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i order = _mm256_setr_epi32 (0, 4, 1, 5, 2, 6, 3, 7);
+	__m256i a = _mm256_cmpeq_epi32 (_mm256_loadu_si256 ((const __m256i*)entries), zero);
+	__m256i b = _mm256_cmpeq_epi32 (_mm256_loadu_si256 ((const __m256i*)(entries + 32)), zero);
+	__m256i c = _mm256_cmpeq_epi32 (_mm256_loadu_si256 ((const __m256i*)(entries + 64)), zero);
+	__m256i d = _mm256_cmpeq_epi32 (_mm256_loadu_si256 ((const __m256i*)(entries + 96)), zero);
+	__m256i packed = _mm256_packs_epi16 (_mm256_packs_epi32 (a, b), _mm256_packs_epi32 (c, d));
+	return (uint32_t)_mm256_movemask_epi8 (_mm256_permutevar8x32_epi32 (packed, order));
+}
 
-				_FAT_cache_readLittleEndianValue (partition->cache, &oldValue, sector, offset, sizeof(u8));
+#elif defined (__SSE2__)
+#include <emmintrin.h>
 
-				value = (value << 4) | (oldValue & 0x0F);
+static inline uint32_t _FAT_fat_freeMask16 (const uint8_t* entries) {
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t mask = 0;
+	int half;
 
-				_FAT_cache_writeLittleEndianValue (partition->cache, value & 0xFF, sector, offset, sizeof(u8));
+	for (half = 0; half < 2; half++, entries += 32) {
+		__m128i a = _mm_cmpeq_epi16 (_mm_loadu_si128 ((const __m128i*)entries), zero);
+		__m128i b = _mm_cmpeq_epi16 (_mm_loadu_si128 ((const __m128i*)(entries + 16)), zero);
+		mask |= (uint32_t)_mm_movemask_epi8 (_mm_packs_epi16 (a, b)) << (half * 16);
+	}
+	return mask;
+}
 
-				offset++;
-				if (offset >= partition->bytesPerSector) {
-					offset = 0;
-					sector++;
-				}
+static inline uint32_t _FAT_fat_freeMask32 (const uint8_t* entries) {
+	const __m128i zero = _mm_setzero_si128();
+	uint32_t mask = 0;
+	int half;
+
+	for (half = 0; half < 2; half++, entries += 64) {
+		__m128i a = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i*)entries), zero);
+		__m128i b = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i*)(entries + 16)), zero);
+		__m128i c = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i*)(entries + 32)), zero);
+		__m128i d = _mm_cmpeq_epi32 (_mm_loadu_si128 ((const __m128i*)(entries + 48)), zero);
+		__m128i packed = _mm_packs_epi16 (_mm_packs_epi32 (a, b), _mm_packs_epi32 (c, d));
+		mask |= (uint32_t)_mm_movemask_epi8 (packed) << (half * 16);
+	}
+	return mask;
+}
 
-				_FAT_cache_writeLittleEndianValue (partition->cache, (value >> 8) & 0xFF, sector, offset, sizeof(u8));
+#elif defined (__ARM_NEON) || defined (__ARM_NEON__)
+#include <arm_neon.h>
 
-			} else {
+/*
+NEON has no movemask, so weight each all-ones byte by its bit and add them up
+*/
+static inline uint32_t _FAT_fat_neonMask (uint8x16_t matches) {
+	static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+	uint64x2_t sums = vpaddlq_u32 (vpaddlq_u16 (vpaddlq_u8 (vandq_u8 (matches, vld1q_u8 (weights)))));
+	return (uint32_t)vgetq_lane_u64 (sums, 0) | ((uint32_t)vgetq_lane_u64 (sums, 1) << 8);
+}
 
-				_FAT_cache_writeLittleEndianValue (partition->cache, value, sector, offset, sizeof(u8));
+static inline uint32_t _FAT_fat_freeMask16 (const uint8_t* entries) {
+	uint32_t mask = 0;
+	int half;
 
-				offset++;
-				if (offset >= partition->bytesPerSector) {
-					offset = 0;
-					sector++;
-				}
+	for (half = 0; half < 2; half++, entries += 32) {
+		uint16x8_t a = vceqq_u16 (vld1q_u16 ((const uint16_t*)entries), vdupq_n_u16 (0));
+		uint16x8_t b = vceqq_u16 (vld1q_u16 ((const uint16_t*)(entries + 16)), vdupq_n_u16 (0));
+		mask |= _FAT_fat_neonMask (vcombine_u8 (vmovn_u16 (a), vmovn_u16 (b))) << (half * 16);
+	}
+	return mask;
+}
 
-				_FAT_cache_readLittleEndianValue (partition->cache, &oldValue, sector, offset, sizeof(u8));
+static inline uint32_t _FAT_fat_freeMask32 (const uint8_t* entries) {
+	uint32_t mask = 0;
+	int half;
+
+	for (half = 0; half < 2; half++, entries += 64) {
+		uint32x4_t a = vceqq_u32 (vld1q_u32 ((const uint32_t*)entries), vdupq_n_u32 (0));
+		uint32x4_t b = vceqq_u32 (vld1q_u32 ((const uint32_t*)(entries + 16)), vdupq_n_u32 (0));
+		uint32x4_t c = vceqq_u32 (vld1q_u32 ((const uint32_t*)(entries + 32)), vdupq_n_u32 (0));
+		uint32x4_t d = vceqq_u32 (vld1q_u32 ((const uint32_t*)(entries + 48)), vdupq_n_u32 (0));
+		uint16x8_t ab = vcombine_u16 (vmovn_u32 (a), vmovn_u32 (b));
+		uint16x8_t cd = vcombine_u16 (vmovn_u32 (c), vmovn_u32 (d));
+		mask |= _FAT_fat_neonMask (vcombine_u8 (vmovn_u16 (ab), vmovn_u16 (cd))) << (half * 16);
+	}
+	return mask;
+}
 
-				value = ((value >> 8) & 0x0F) | (oldValue & 0xF0);
+#else
+
+static inline uint32_t _FAT_fat_freeMask16 (const uint8_t* entries) {
+	uint32_t mask = 0;
+	int entry;
+
+	for (entry = 0; entry < FAT_SCAN_GROUP; entry++, entries += 2) {
+		if ((entries[0] | entries[1]) == 0) {
+			mask |= 1u << entry;
+		}
+	}
+	return mask;
+}
 
-				_FAT_cache_writeLittleEndianValue (partition->cache, value, sector, offset, sizeof(u8));
+static inline uint32_t _FAT_fat_freeMask32 (const uint8_t* entries) {
+	uint32_t mask = 0;
+	int entry;
+
+	for (entry = 0; entry < FAT_SCAN_GROUP; entry++, entries += 4) {
+		if ((entries[0] | entries[1] | entries[2] | entries[3]) == 0) {
+			mask |= 1u << entry;
+		}
+	}
+	return mask;
+}
+
+#endif
+
+/*
+FAT12 packs two entries into every three bytes, so decode a pair at a time
+*/
+static inline uint32_t _FAT_fat_freeMask12 (const uint8_t* entries) {
+	uint32_t mask = 0;
+	uint32_t pair;
+	int entry;
+
+	for (entry = 0; entry < FAT_SCAN_GROUP; entry += 2, entries += 3) {
+		pair = entries[0] | (entries[1] << 8) | (entries[2] << 16);
+		if ((pair & 0x000FFF) == 0) {
+			mask |= 1u << entry;
+		}
+		if ((pair & 0xFFF000) == 0) {
+			mask |= 2u << entry;
+		}
+	}
+	return mask;
+}
+
+/*
+Entry by entry scan of clusters first to last, for when the FAT can't be read in bulk
+*/
+static unsigned int _FAT_fat_scanFreeClustersSlow (PARTITION* partition, uint32_t* map, uint32_t first, uint32_t last) {
+	unsigned int count = 0;
+	uint32_t cluster;
+
+	for (cluster = first; cluster <= last; cluster++) {
+		if (_FAT_fat_nextCluster(partition, cluster) == CLUSTER_FREE) {
+			count++;
+			if (map) {
+				map[cluster >> 5] |= (1u << (cluster & 31));
 			}
+		}
+	}
+	return count;
+}
 
+/*
+Count the free clusters in the FAT, also filling in map if it isn't NULL.
+The FAT is read in bulk, bypassing the cache where it can, and checked 32
+entries at a time. A FAT12 FAT is small enough to read in one go, which
+saves decoding entries that straddle a sector boundary.
+*/
+static unsigned int _FAT_fat_scanFreeClusters (PARTITION* partition, uint32_t* map) {
+	uint32_t lastCluster = partition->fat.lastCluster;
+	unsigned int count = 0;
+	unsigned int groupBytes;
+	uint32_t (*freeMask) (const uint8_t* entries);
+	sec_t fatSectors, chunkSectors, readSectors, sector;
+	uint32_t cluster, chunkEnd, mask;
+	unsigned int offset;
+	uint8_t* buffer;
+
+	switch (partition->filesysType) {
+		case FS_FAT12:
+			freeMask = _FAT_fat_freeMask12;
+			groupBytes = 12 * FAT_SCAN_GROUP / 8;
 			break;
-
 		case FS_FAT16:
-			sector = partition->fat.fatStart + ((cluster << 1) / partition->bytesPerSector);
-			offset = (cluster % (partition->bytesPerSector >> 1)) << 1;
+			freeMask = _FAT_fat_freeMask16;
+			groupBytes = 16 * FAT_SCAN_GROUP / 8;
+			break;
+		case FS_FAT32:
+			freeMask = _FAT_fat_freeMask32;
+			groupBytes = 32 * FAT_SCAN_GROUP / 8;
+			break;
+		default:
+			return 0;
+	}
 
-			_FAT_cache_writeLittleEndianValue (partition->cache, value, sector, offset, sizeof(u16));
+	// Sectors holding every group up to the one with lastCluster in it
+	fatSectors = (((lastCluster / FAT_SCAN_GROUP) + 1) * groupBytes + partition->bytesPerSector - 1) >> partition->fat.sectorShift;
+	chunkSectors = (partition->filesysType == FS_FAT12 || fatSectors < FAT_SCAN_SECTORS) ? fatSectors : FAT_SCAN_SECTORS;
 
-			break;
+	buffer = (uint8_t*) _FAT_mem_align (chunkSectors * partition->bytesPerSector);
+	if (buffer == NULL) {
+		return _FAT_fat_scanFreeClustersSlow (partition, map, CLUSTER_FIRST, lastCluster);
+	}
 
-		case FS_FAT32:
-			sector = partition->fat.fatStart + ((cluster << 2) / partition->bytesPerSector);
-			offset = (cluster % (partition->bytesPerSector >> 2)) << 2;
+	for (sector = 0, cluster = 0; cluster <= lastCluster; sector += chunkSectors) {
+		if (chunkSectors > fatSectors - sector) {
+			chunkSectors = fatSectors - sector;
+		}
+		chunkEnd = cluster + ((chunkSectors << partition->fat.sectorShift) / groupBytes) * FAT_SCAN_GROUP - 1;
+		if (chunkEnd > lastCluster) {
+			chunkEnd = lastCluster;
+		}
 
-			_FAT_cache_writeLittleEndianValue (partition->cache, value, sector, offset, sizeof(u32));
+		// The last group may run past the end of the FAT. Those entries are masked off
+		readSectors = chunkSectors;
+		if (sector + readSectors > partition->fat.sectorsPerFat) {
+			readSectors = (sector < partition->fat.sectorsPerFat) ? partition->fat.sectorsPerFat - sector : 0;
+			memset (buffer + readSectors * partition->bytesPerSector, 0, (chunkSectors - readSectors) * partition->bytesPerSector);
+		}
+		if ((readSectors > 0) &&
+			!_FAT_cache_readSectors (partition->metaCache, partition->fat.fatStart + sector, readSectors, buffer))
+		{
+			count += _FAT_fat_scanFreeClustersSlow (partition, map, (cluster < CLUSTER_FIRST) ? CLUSTER_FIRST : cluster, chunkEnd);
+			cluster = chunkEnd + 1;
+			continue;
+		}
 
-			break;
+		for (offset = 0; cluster <= chunkEnd; offset += groupBytes, cluster += FAT_SCAN_GROUP) {
+			mask = freeMask (buffer + offset);
+			if (cluster < CLUSTER_FIRST) {
+				// The first two entries are reserved
+				mask &= ~((1u << CLUSTER_FIRST) - 1);
+			}
+			if (lastCluster - cluster < FAT_SCAN_GROUP - 1) {
+				mask &= (2u << (lastCluster - cluster)) - 1;
+			}
+			count += __builtin_popcount (mask);
+			if (map) {
+				map[cluster >> 5] = mask;
+			}
+		}
+	}
 
-		default:
+	_FAT_mem_free (buffer);
+	return count;
+}
+
+/*
+Build the free cluster map from the FAT, if it is enabled and not built yet.
+Returns the number of free clusters, or CLUSTER_ERROR if there is no map.
+*/
+static uint32_t _FAT_fat_buildFreeMap (PARTITION* partition) {
+	uint32_t bytes;
+	uint32_t* map;
+
+	if (!partition->fat.freeMapEnabled || partition->fat.freeMap) {
+		return CLUSTER_ERROR;
+	}
+
+	bytes = ((partition->fat.lastCluster >> 5) + 1) * sizeof(uint32_t);
+	map = (uint32_t*) _FAT_mem_allocate (bytes);
+	if (map == NULL) {
+		// Carry on reading the FAT, rather than retrying the allocation every time
+		partition->fat.freeMapEnabled = false;
+		return CLUSTER_ERROR;
+	}
+	memset (map, 0, bytes);
+
+	partition->fat.freeMap = map;
+	partition->fat.freeMapBytes = bytes;
+	return _FAT_fat_scanFreeClusters (partition, map);
+}
+
+/*
+Return the first free cluster at or after start according to the free cluster map,
+or CLUSTER_FREE if there are none. Works through the map a word at a time.
+*/
+static uint32_t _FAT_fat_findFreeInMap (PARTITION* partition, uint32_t start) {
+	const uint32_t* map = partition->fat.freeMap;
+	uint32_t words = (partition->fat.lastCluster >> 5) + 1;
+	uint32_t word = start >> 5;
+	uint32_t bits;
+
+	if (word >= words) {
+		return CLUSTER_FREE;
+	}
+
+	// Only clusters CLUSTER_FIRST to lastCluster ever have their bit set
+	bits = map[word] & (~0u << (start & 31));
+	while (bits == 0) {
+		if (++word >= words) {
+			return CLUSTER_FREE;
+		}
+		bits = map[word];
+	}
+
+	return (word << 5) + __builtin_ctz(bits);
+}
+
+/*
+Return the first cluster at or after start that isn't free according to the
+free cluster map, or lastCluster + 1 if they all are
+*/
+static uint32_t _FAT_fat_freeRunEnd (PARTITION* partition, uint32_t start) {
+	const uint32_t* map = partition->fat.freeMap;
+	uint32_t words = (partition->fat.lastCluster >> 5) + 1;
+	uint32_t word = start >> 5;
+	uint32_t bits;
+
+	if (word >= words) {
+		return partition->fat.lastCluster + 1;
+	}
+
+	bits = ~map[word] & (~0u << (start & 31));
+	while (bits == 0) {
+		if (++word >= words) {
+			return partition->fat.lastCluster + 1;
+		}
+		bits = ~map[word];
+	}
+
+	start = (word << 5) + __builtin_ctz(bits);
+	return (start > partition->fat.lastCluster) ? partition->fat.lastCluster + 1 : start;
+}
+
+/*
+Find the free run that best fits wanted clusters: the shortest that is long enough,
+or failing that the longest there is. Returns its length, capped at wanted, and its
+first cluster in start. Returns 0 if there are no free clusters.
+*/
+static uint32_t _FAT_fat_bestFreeRun (PARTITION* partition, uint32_t wanted, uint32_t* start) {
+	uint32_t bestStart = CLUSTER_FREE;
+	uint32_t bestLength = 0;
+	uint32_t runStart, runLength;
+	uint32_t cluster = CLUSTER_FIRST;
+
+	while ((runStart = _FAT_fat_findFreeInMap (partition, cluster)) != CLUSTER_FREE) {
+		cluster = _FAT_fat_freeRunEnd (partition, runStart);
+		runLength = cluster - runStart;
+
+		if ((bestLength < wanted) ? (runLength > bestLength) : (runLength >= wanted && runLength < bestLength)) {
+			bestStart = runStart;
+			bestLength = runLength;
+			if (bestLength == wanted) {
+				break;
+			}
+		}
+	}
+
+	*start = bestStart;
+	return (bestLength < wanted) ? bestLength : wanted;
+}
+
+/*
+Chain length clusters from start to each other, ending the chain at the last.
+FAT16 and FAT32 entries are written in place a FAT sector at a time rather
+than one by one. Returns false if part of the run couldn't be written.
+*/
+static bool _FAT_fat_writeRun (PARTITION* partition, uint32_t start, uint32_t length) {
+	uint32_t end = start + length - 1;
+	uint32_t cluster, value, entryMask;
+	unsigned int entryShift, sectorShift, offset, count, i;
+	uint8_t* data;
+	bool ok = true;
+
+	if ((partition->filesysType != FS_FAT16) && (partition->filesysType != FS_FAT32)) {
+		for (cluster = start; cluster < end; cluster++) {
+			ok = _FAT_fat_writeFatEntry (partition, cluster, cluster + 1) && ok;
+		}
+		return _FAT_fat_writeFatEntry (partition, end, CLUSTER_EOF) && ok;
+	}
+
+	entryShift = (partition->filesysType == FS_FAT16) ? 1 : 2;
+	sectorShift = partition->fat.sectorShift - entryShift;
+	entryMask = (1u << sectorShift) - 1;
+	for (cluster = start; cluster <= end; cluster += count) {
+		data = _FAT_fat_modifySector (partition, partition->fat.fatStart + (cluster >> sectorShift));
+		if (data == NULL) {
 			return false;
-			break;
+		}
+		// Stay within the sector
+		count = entryMask + 1 - (cluster & entryMask);
+		if (count > end - cluster + 1) {
+			count = end - cluster + 1;
+		}
+
+		for (i = 0; i < count; i++) {
+			value = (cluster + i == end) ? CLUSTER_EOF : cluster + i + 1;
+			offset = ((cluster + i) & entryMask) << entryShift;
+			if (entryShift == 1) {
+				u16_to_u8array (data, offset, (uint16_t)value);
+			} else {
+				u32_to_u8array (data, offset, value);
+			}
+			if (partition->fat.freeMap) {
+				partition->fat.freeMap[(cluster + i) >> 5] &= ~(1u << ((cluster + i) & 31));
+			}
+		}
 	}
 
 	return true;
 }
 
+/*
+Enable or disable the free cluster map. Disabling frees it.
+Enabling builds it straight away and fails if there isn't enough memory.
+*/
+bool _FAT_fat_setFreeMap (PARTITION* partition, bool enable) {
+	if (!enable) {
+		_FAT_mem_free (partition->fat.freeMap);
+		partition->fat.freeMap = NULL;
+		partition->fat.freeMapBytes = 0;
+		partition->fat.freeMapEnabled = false;
+		return true;
+	}
+
+	partition->fat.freeMapEnabled = true;
+	_FAT_fat_buildFreeMap (partition);
+	return partition->fat.freeMap != NULL;
+}
+
+/*
+Copy the FAT sectors changed since the last call to every mirror FAT, in
+ascending order with adjacent sectors sent as one write. The active FAT must
+already be flushed, since the sectors are read back through the cache but
+written straight to the disc.
+*/
+bool _FAT_fat_syncMirrors (PARTITION* partition) {
+	uint32_t* dirty = partition->fat.mirrorDirty;
+	uint32_t index, last, count, maxSectors;
+	unsigned int mirror;
+	uint8_t* buffer;
+
+	if ((partition->fat.mirrorCount == 0) || (partition->fat.mirrorDirtyFirst > partition->fat.mirrorDirtyLast)) {
+		return true;
+	}
+
+	maxSectors = FAT_SCAN_SECTORS;
+	buffer = (uint8_t*) _FAT_mem_align (maxSectors * partition->bytesPerSector);
+	if (buffer == NULL) {
+		maxSectors = 1;
+		buffer = (uint8_t*) _FAT_mem_align (partition->bytesPerSector);
+		if (buffer == NULL) {
+			return false;
+		}
+	}
+
+	index = partition->fat.mirrorDirtyFirst;
+	last = partition->fat.mirrorDirtyLast;
+	while (index <= last) {
+		if (dirty && !(dirty[index >> 5] & (1u << (index & 31)))) {
+			// Skip clean words whole
+			index = (((index & 31) == 0) && (dirty[index >> 5] == 0)) ? index + 32 : index + 1;
+			continue;
+		}
+
+		count = 1;
+		while ((count < maxSectors) && (index + count <= last) &&
+			(!dirty || (dirty[(index + count) >> 5] & (1u << ((index + count) & 31)))))
+		{
+			count++;
+		}
+
+		if (!_FAT_cache_readSectors (partition->metaCache, partition->fat.fatStart + index, count, buffer)) {
+			break;
+		}
+		for (mirror = 1; mirror <= partition->fat.mirrorCount; mirror++) {
+			if (!_FAT_disc_writeSectors (partition->disc, partition->fat.fatStart + (sec_t)mirror * partition->fat.sectorsPerFat + index, count, buffer)) {
+				break;
+			}
+		}
+		if (mirror <= partition->fat.mirrorCount) {
+			break;
+		}
+
+		if (dirty) {
+			for (; count > 0; count--, index++) {
+				dirty[index >> 5] &= ~(1u << (index & 31));
+			}
+		} else {
+			index += count;
+		}
+	}
+
+	_FAT_mem_free (buffer);
+
+	// Whatever is left is tried again next time
+	partition->fat.mirrorDirtyFirst = index;
+	return index > last;
+}
+
 /*-----------------------------------------------------------------
 gets the first available free cluster, sets it
 to end of file, links the input cluster to it then returns the
@@ -230,6 +803,23 @@ uint32_t _FAT_fat_linkFreeCluster(PARTITION* partition, uint32_t cluster) {
 		firstFree = CLUSTER_FIRST;
 	}
 
+	if (partition->fat.freeMap == NULL) {
+		_FAT_fat_buildFreeMap (partition);
+	}
+
+	if (partition->fat.freeMap) {
+		// The map gives the answer without reading the FAT, looping back to the start if needed
+		firstFree = _FAT_fat_findFreeInMap (partition, firstFree);
+		if (firstFree == CLUSTER_FREE) {
+			firstFree = _FAT_fat_findFreeInMap (partition, CLUSTER_FIRST);
+		}
+		if (firstFree == CLUSTER_FREE) {
+			partition->fat.firstFree = lastCluster + 1;
+			return CLUSTER_ERROR;
+		}
+		// The search below then only confirms it against the FAT
+	}
+
 	// Search until a free cluster is found
 	while (_FAT_fat_nextCluster(partition, firstFree) != CLUSTER_FREE) {
 		firstFree++;
@@ -262,6 +852,98 @@ uint32_t _FAT_fat_linkFreeCluster(PARTITION* partition, uint32_t cluster) {
 	return firstFree;
 }
 
+/*-----------------------------------------------------------------
+_FAT_fat_allocateExtent
+Allocate up to nClusters clusters and link them on from prevCluster,
+or start a new chain if prevCluster is CLUSTER_FREE. The clusters are
+taken from as few contiguous free runs as possible, continuing on
+from prevCluster if the cluster after it is free, then best fit.
+Fewer clusters are allocated if there aren't enough free.
+If runs isn't NULL, it receives the number of runs used.
+Returns the first new cluster, or the cluster already linked from
+prevCluster, or CLUSTER_ERROR if nothing could be allocated.
+Without the free cluster map, only one cluster is allocated.
+-----------------------------------------------------------------*/
+uint32_t _FAT_fat_allocateExtent (PARTITION* partition, uint32_t prevCluster, uint32_t nClusters, unsigned int* runs) {
+	uint32_t lastCluster = partition->fat.lastCluster;
+	uint32_t firstCluster = CLUSTER_ERROR;
+	uint32_t curLink, start, length;
+	unsigned int runCount = 0;
+
+	if (runs) {
+		*runs = 0;
+	}
+
+	if ((prevCluster > lastCluster) || (nClusters == 0)) {
+		return CLUSTER_ERROR;
+	}
+
+	// Check if the cluster already has a link, and return it if so
+	curLink = _FAT_fat_nextCluster(partition, prevCluster);
+	if ((curLink >= CLUSTER_FIRST) && (curLink <= lastCluster)) {
+		return curLink;
+	}
+
+	if (partition->fat.freeMap == NULL) {
+		_FAT_fat_buildFreeMap (partition);
+	}
+	if ((partition->fat.freeMap == NULL) || (nClusters == 1)) {
+		firstCluster = _FAT_fat_linkFreeCluster (partition, prevCluster);
+		if (runs && _FAT_fat_isValidCluster (partition, firstCluster)) {
+			*runs = 1;
+		}
+		return firstCluster;
+	}
+
+	while (nClusters > 0) {
+		if (_FAT_fat_isValidCluster (partition, prevCluster) && (prevCluster < lastCluster) &&
+			(partition->fat.freeMap[(prevCluster + 1) >> 5] & (1u << ((prevCluster + 1) & 31))))
+		{
+			// Keep the file contiguous
+			start = prevCluster + 1;
+			length = _FAT_fat_freeRunEnd (partition, start) - start;
+			if (length > nClusters) {
+				length = nClusters;
+			}
+		} else {
+			length = _FAT_fat_bestFreeRun (partition, nClusters, &start);
+			if (length == 0) {
+				break;
+			}
+		}
+
+		if (!_FAT_fat_writeRun (partition, start, length) ||
+			(_FAT_fat_isValidCluster (partition, prevCluster) && !_FAT_fat_writeFatEntry (partition, prevCluster, start)))
+		{
+			// Give back whatever part of the run made it into the FAT
+			for (curLink = start; curLink < start + length; curLink++) {
+				_FAT_fat_writeFatEntry (partition, curLink, CLUSTER_FREE);
+			}
+			break;
+		}
+
+		if (firstCluster == CLUSTER_ERROR) {
+			firstCluster = start;
+		}
+		if (partition->fat.numberFreeCluster > length) {
+			partition->fat.numberFreeCluster -= length;
+		} else {
+			partition->fat.numberFreeCluster = 0;
+		}
+		prevCluster = start + length - 1;
+		nClusters -= length;
+		runCount++;
+	}
+
+	if (runCount > 0) {
+		partition->fat.numberLastAllocCluster = prevCluster;
+	}
+	if (runs) {
+		*runs = runCount;
+	}
+	return firstCluster;
+}
+
 /*-----------------------------------------------------------------
 gets the first available free cluster, sets it
 to end of file, links the input cluster to it, clears the new
@@ -285,7 +967,7 @@ uint32_t _FAT_fat_linkFreeClusterCleared (PARTITION* partition, uint32_t cluster
 	// Clear all the sectors within the cluster
 	memset (emptySector, 0, partition->bytesPerSector);
 	for (i = 0; i < partition->sectorsPerCluster; i++) {
-		_FAT_cache_writeSectors (partition->cache,
+		_FAT_cache_writeSectors (partition->metaCache,
 			_FAT_fat_clusterToSector (partition, newCluster) + i,
 			1, emptySector);
 	}
@@ -296,12 +978,87 @@ uint32_t _FAT_fat_linkFreeClusterCleared (PARTITION* partition, uint32_t cluster
 }
 
 
+/*
+With separate pools, a freed cluster may be reused by the other pool's
+kind of data, so neither may hold on to stale contents for it
+*/
+static void _FAT_fat_discardClusters (PARTITION* partition, uint32_t cluster, uint32_t count) {
+	if (partition->metaCache != partition->cache) {
+		_FAT_cache_discardSectors (partition->cache, _FAT_fat_clusterToSector (partition, cluster), count * partition->sectorsPerCluster);
+		_FAT_cache_discardSectors (partition->metaCache, _FAT_fat_clusterToSector (partition, cluster), count * partition->sectorsPerCluster);
+	}
+}
+
+/*
+Free the FAT16 or FAT32 chain from cluster a FAT sector at a time. Each sector
+is looked up once and every entry of the chain that lands in it is cleared in
+place. Stops early if a FAT sector can't be read. Returns the number of clusters freed.
+*/
+static uint32_t _FAT_fat_clearChainBatched (PARTITION* partition, uint32_t cluster) {
+	unsigned int entryShift = (partition->filesysType == FS_FAT16) ? 1 : 2;
+	unsigned int sectorShift = partition->fat.sectorShift - entryShift;
+	uint32_t entryMask = (1u << sectorShift) - 1;
+	uint32_t endOfChain = (partition->filesysType == FS_FAT16) ? 0xFFF7 : 0x0FFFFFF7;
+	uint32_t freed = 0;
+	uint32_t runStart = cluster, runLength = 0;
+	uint32_t firstEntry, nextCluster;
+	unsigned int offset;
+	uint8_t* data;
+
+	while (_FAT_fat_isValidCluster (partition, cluster)) {
+		data = _FAT_fat_modifySector (partition, partition->fat.fatStart + (cluster >> sectorShift));
+		if (data == NULL) {
+			break;
+		}
+		firstEntry = cluster & ~entryMask;
+
+		// A cluster already cleared reads back as free, so even a looped chain ends
+		do {
+			offset = (cluster & entryMask) << entryShift;
+			if (entryShift == 1) {
+				nextCluster = u8array_to_u16 (data, offset);
+				u16_to_u8array (data, offset, CLUSTER_FREE);
+			} else {
+				nextCluster = u8array_to_u32 (data, offset);
+				u32_to_u8array (data, offset, CLUSTER_FREE);
+			}
+			if (nextCluster >= endOfChain) {
+				nextCluster = CLUSTER_EOF;
+			}
+			if (partition->fat.freeMap) {
+				partition->fat.freeMap[cluster >> 5] |= (1u << (cluster & 31));
+			}
+			freed++;
+
+			if ((runLength > 0) && (cluster == runStart + runLength)) {
+				runLength++;
+			} else {
+				if (runLength > 0) {
+					_FAT_fat_discardClusters (partition, runStart, runLength);
+				}
+				runStart = cluster;
+				runLength = 1;
+			}
+
+			cluster = nextCluster;
+		} while (((cluster & ~entryMask) == firstEntry) && _FAT_fat_isValidCluster (partition, cluster));
+	}
+
+	if (runLength > 0) {
+		_FAT_fat_discardClusters (partition, runStart, runLength);
+	}
+
+	return freed;
+}
+
 /*-----------------------------------------------------------------
 _FAT_fat_clearLinks
 frees any cluster used by a file
 -----------------------------------------------------------------*/
 bool _FAT_fat_clearLinks (PARTITION* partition, uint32_t cluster) {
 	uint32_t nextCluster;
+	uint32_t freed = 0;
+	uint32_t maxFree = partition->numberOfSectors / partition->sectorsPerCluster;
 
 	if ((cluster < CLUSTER_FIRST) || (cluster > partition->fat.lastCluster /* This will catch CLUSTER_ERROR */))
 		return false;
@@ -311,17 +1068,27 @@ bool _FAT_fat_clearLinks (PARTITION* partition, uint32_t cluster) {
 		partition->fat.firstFree = cluster;
 	}
 
-	while ((cluster != CLUSTER_EOF) && (cluster != CLUSTER_FREE) && (cluster != CLUSTER_ERROR)) {
-		// Store next cluster before erasing the link
-		nextCluster = _FAT_fat_nextCluster (partition, cluster);
-
-		// Erase the link
-		_FAT_fat_writeFatEntry (partition, cluster, CLUSTER_FREE);
+	if ((partition->filesysType == FS_FAT16) || (partition->filesysType == FS_FAT32)) {
+		freed = _FAT_fat_clearChainBatched (partition, cluster);
+	} else {
+		// FAT12 entries share bytes, so they are freed one at a time
+		while ((cluster != CLUSTER_EOF) && (cluster != CLUSTER_FREE) && (cluster != CLUSTER_ERROR)) {
+			// Store next cluster before erasing the link
+			nextCluster = _FAT_fat_nextCluster (partition, cluster);
+
+			// Erase the link
+			_FAT_fat_writeFatEntry (partition, cluster, CLUSTER_FREE);
+			_FAT_fat_discardClusters (partition, cluster, 1);
+
+			freed++;
+			// Move onto next cluster
+			cluster = nextCluster;
+		}
+	}
 
-		if(partition->fat.numberFreeCluster < (partition->numberOfSectors/partition->sectorsPerCluster))
-			partition->fat.numberFreeCluster++;
-		// Move onto next cluster
-		cluster = nextCluster;
+	partition->fat.numberFreeCluster += freed;
+	if (partition->fat.numberFreeCluster > maxFree) {
+		partition->fat.numberFreeCluster = maxFree;
 	}
 
 	return true;
@@ -375,18 +1142,49 @@ uint32_t _FAT_fat_lastCluster (PARTITION* partition, uint32_t cluster) {
 	return cluster;
 }
 
+/*-----------------------------------------------------------------
+_FAT_fat_contiguousSectors
+Count the sectors that follow on physically from sector sector of
+cluster, following the chain while it stays contiguous. Stops once
+maxSectors is reached. The FAT16 root directory is one contiguous run.
+-----------------------------------------------------------------*/
+sec_t _FAT_fat_contiguousSectors (PARTITION* partition, uint32_t cluster, sec_t sector, sec_t maxSectors) {
+	sec_t run;
+
+	if (cluster == CLUSTER_ROOT) {
+		run = (partition->dataStart - partition->rootDirStart) - sector;
+		return (run < maxSectors) ? run : maxSectors;
+	}
+
+	run = partition->sectorsPerCluster - sector;
+	while (run < maxSectors && _FAT_fat_nextCluster(partition, cluster) == cluster + 1) {
+		cluster++;
+		run += partition->sectorsPerCluster;
+	}
+
+	return (run < maxSectors) ? run : maxSectors;
+}
+
 /*-----------------------------------------------------------------
 _FAT_fat_freeClusterCount
 Return the number of free clusters available
 -----------------------------------------------------------------*/
 unsigned int _FAT_fat_freeClusterCount (PARTITION* partition) {
 	unsigned int count = 0;
-	uint32_t curCluster;
+	uint32_t word, words;
 
-	for (curCluster = CLUSTER_FIRST; curCluster <= partition->fat.lastCluster; curCluster++) {
-		if (_FAT_fat_nextCluster(partition, curCluster) == CLUSTER_FREE) {
-			count++;
+	if (partition->fat.freeMap == NULL) {
+		// Reading the whole FAT anyway, so build the map on the way if it is wanted
+		count = _FAT_fat_buildFreeMap (partition);
+		if (count != CLUSTER_ERROR) {
+			return count;
 		}
+		return _FAT_fat_scanFreeClusters (partition, NULL);
+	}
+
+	words = (partition->fat.lastCluster >> 5) + 1;
+	for (word = 0; word < words; word++) {
+		count += __builtin_popcount (partition->fat.freeMap[word]);
 	}
 
 	return count;
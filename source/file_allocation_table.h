@@ -44,19 +44,37 @@
 #define CLUSTERS_PER_FAT16 65525
 
 
-uint32_t _FAT_fat_nextCluster(PARTITION* partition, uint32_t cluster);
+/*
+Pick the FAT entry accessors for the partition's FAT type and sector size
+*/
+void _FAT_fat_setAccessors (PARTITION* partition);
+
+/*
+Gets the cluster linked from input cluster
+*/
+static inline uint32_t _FAT_fat_nextCluster (PARTITION* partition, uint32_t cluster) {
+	return partition->fat.nextCluster (partition, cluster);
+}
 
 uint32_t _FAT_fat_linkFreeCluster(PARTITION* partition, uint32_t cluster);
 uint32_t _FAT_fat_linkFreeClusterCleared (PARTITION* partition, uint32_t cluster);
 
+uint32_t _FAT_fat_allocateExtent (PARTITION* partition, uint32_t prevCluster, uint32_t nClusters, unsigned int* runs);
+
 bool _FAT_fat_clearLinks (PARTITION* partition, uint32_t cluster);
 
 uint32_t _FAT_fat_trimChain (PARTITION* partition, uint32_t startCluster, unsigned int chainLength);
 
 uint32_t _FAT_fat_lastCluster (PARTITION* partition, uint32_t cluster);
 
+sec_t _FAT_fat_contiguousSectors (PARTITION* partition, uint32_t cluster, sec_t sector, sec_t maxSectors);
+
 unsigned int _FAT_fat_freeClusterCount (PARTITION* partition);
 
+bool _FAT_fat_setFreeMap (PARTITION* partition, bool enable);
+
+bool _FAT_fat_syncMirrors (PARTITION* partition);
+
 static inline sec_t _FAT_fat_clusterToSector (PARTITION* partition, uint32_t cluster) {
 	return (cluster >= CLUSTER_FIRST) ? 
 		((cluster - CLUSTER_FIRST) * (sec_t)partition->sectorsPerCluster) + partition->dataStart : 
@@ -40,6 +40,8 @@
 #include "lock.h"
 #include "mem_allocate.h"
 #include "disc.h"
+#include "file_allocation_table.h"
+#include "fatcachestats.h"
 
 #include <_timeval.h>
 typedef long off32_t;
@@ -123,7 +125,31 @@ static const devoptab_t dotab_fat = {
 	_FAT_stat_r, // This is lstat, but we don't support symlinks
 };
 
-bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage) {
+/*
+Find the libfat partition mounted as name, or NULL if there is none
+*/
+static PARTITION* _FAT_getMountedPartition (const char* name) {
+	devoptab_t *devops;
+
+	if(!name)
+		return NULL;
+
+	devops = (devoptab_t*)GetDeviceOpTab (name);
+	if (!devops) {
+		return NULL;
+	}
+
+	// Perform a quick check to make sure we're dealing with a libfat controlled device
+	if (devops->open_r != dotab_fat.open_r) {
+		return NULL;
+	}
+
+	return (PARTITION*)devops->deviceData;
+}
+
+bool fatMountWithMetaCache (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage,
+	uint32_t metaCacheSize, uint32_t metaSectorsPerPage, bool freeClusterMap)
+{
 	PARTITION* partition;
 	devoptab_t* devops;
 	char* nameCopy;
@@ -151,7 +177,8 @@ bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSec
 	nameCopy = (char*)(devops+1);
 
 	// Initialize the file system
-	partition = _FAT_partition_constructor (interface, cacheSize, SectorsPerPage, startSector);
+	partition = _FAT_partition_constructor (interface, cacheSize, SectorsPerPage, metaCacheSize, metaSectorsPerPage,
+		freeClusterMap, startSector);
 	if (!partition) {
 		_FAT_mem_free (devops);
 		return false;
@@ -168,6 +195,11 @@ bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSec
 	return true;
 }
 
+bool fatMount (const char* name, const DISC_INTERFACE* interface, sec_t startSector, uint32_t cacheSize, uint32_t SectorsPerPage) {
+	return fatMountWithMetaCache (name, interface, startSector, cacheSize, SectorsPerPage, DEFAULT_META_CACHE_PAGES, DEFAULT_META_SECTORS_PAGE,
+		DEFAULT_FREE_CLUSTER_MAP);
+}
+
 bool fatMountSimple (const char* name, const DISC_INTERFACE* interface) {
 	return fatMount (name, interface, 0, DEFAULT_CACHE_PAGES, DEFAULT_SECTORS_PAGE);
 }
@@ -307,3 +339,228 @@ void fatGetVolumeLabel (const char* name, char *label) {
 	}
 	if(!strncmp(label, "NO NAME", 7)) label[0]='\0';
 }
+
+bool fatSetCacheFlushMode (const char* name, bool coalesce, uint32_t maxTransferSectors) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+
+	if (!partition) {
+		return false;
+	}
+
+	_FAT_lock(&partition->lock);
+	_FAT_cache_setFlushMode (partition->cache, coalesce ? CACHE_FLUSH_COALESCED : CACHE_FLUSH_PAGES, maxTransferSectors);
+	if (partition->metaCache != partition->cache) {
+		_FAT_cache_setFlushMode (partition->metaCache, coalesce ? CACHE_FLUSH_COALESCED : CACHE_FLUSH_PAGES, maxTransferSectors);
+	}
+	_FAT_unlock(&partition->lock);
+
+	return true;
+}
+
+/*
+Add up the statistics of both cache pools of a partition.
+Does no locking of its own -- lock the partition before calling.
+*/
+static void _FAT_getCacheStats (PARTITION* partition, CACHE_STATS* stats) {
+	const CACHE_STATS* meta = &partition->metaCache->stats;
+
+	*stats = partition->cache->stats;
+	if (partition->metaCache == partition->cache) {
+		return;
+	}
+
+	stats->hits += meta->hits;
+	stats->misses += meta->misses;
+	stats->evictions += meta->evictions;
+	stats->dirtyWritebacks += meta->dirtyWritebacks;
+	stats->sectorsRead += meta->sectorsRead;
+	stats->sectorsWritten += meta->sectorsWritten;
+	stats->partialReads += meta->partialReads;
+	stats->partialWrites += meta->partialWrites;
+	stats->fullSectorReads += meta->fullSectorReads;
+	stats->fullSectorWrites += meta->fullSectorWrites;
+	stats->bytesCopied += meta->bytesCopied;
+	stats->backgroundWritebacks += meta->backgroundWritebacks;
+	stats->queuedTransfers += meta->queuedTransfers;
+	stats->mappedSectors += meta->mappedSectors;
+}
+
+uint32_t fatGetCacheFlushSavings (const char* name) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+
+	if (!partition) {
+		return 0;
+	}
+
+	if (partition->metaCache != partition->cache) {
+		return partition->cache->flushCallsSaved + partition->metaCache->flushCallsSaved;
+	}
+	return partition->cache->flushCallsSaved;
+}
+
+bool fatSetReadAhead (const char* name, uint32_t windowPages, uint32_t maxInFlightPages) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+
+	if (!partition) {
+		return false;
+	}
+
+	_FAT_lock(&partition->lock);
+	_FAT_cache_setReadAhead (partition->cache, windowPages, maxInFlightPages);
+	if (partition->metaCache != partition->cache) {
+		_FAT_cache_setReadAhead (partition->metaCache, windowPages, maxInFlightPages);
+	}
+	_FAT_unlock(&partition->lock);
+
+	return true;
+}
+
+bool fatSetCacheGeometry (const char* name, uint32_t cacheSize, uint32_t SectorsPerPage) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+	CACHE* cache;
+
+	if (!partition) {
+		return false;
+	}
+
+	_FAT_lock(&partition->lock);
+	// Open files only hold the partition, so swapping its cache is safe under the lock
+	cache = _FAT_cache_resize (partition->cache, cacheSize, SectorsPerPage);
+	if (cache) {
+		if (partition->metaCache == partition->cache) {
+			partition->metaCache = cache;
+		}
+		partition->cache = cache;
+		// The FAT may have been read through the old cache
+		partition->fat.pinData = NULL;
+	}
+	_FAT_unlock(&partition->lock);
+
+	return cache != NULL;
+}
+
+bool fatSetWriteback (const char* name, uint32_t maxAgeMs, uint32_t dirtyRatio) {
+#ifdef USE_WRITEBACK_THREAD
+	PARTITION* partition = _FAT_getMountedPartition (name);
+
+	if (!partition || dirtyRatio > 100) {
+		return false;
+	}
+
+	return _FAT_partition_setWriteback (partition, maxAgeMs, dirtyRatio);
+#else
+	return false;
+#endif
+}
+
+bool fatSetFreeClusterMap (const char* name, bool enable) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+	bool ret;
+
+	if (!partition) {
+		return false;
+	}
+
+	_FAT_lock(&partition->lock);
+	ret = _FAT_fat_setFreeMap (partition, enable);
+	_FAT_unlock(&partition->lock);
+
+	return ret;
+}
+
+uint32_t fatGetFreeClusterMapSize (const char* name) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+	uint32_t bytes;
+
+	if (!partition) {
+		return 0;
+	}
+
+	_FAT_lock(&partition->lock);
+	bytes = partition->fat.freeMapBytes;
+	_FAT_unlock(&partition->lock);
+
+	return bytes;
+}
+
+bool fatGetReadAheadStats (const char* name, uint32_t* hits, uint32_t* wasted) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+
+	if (!partition) {
+		return false;
+	}
+
+	_FAT_lock(&partition->lock);
+	if (hits) {
+		*hits = partition->cache->readAheadHits;
+		if (partition->metaCache != partition->cache) {
+			*hits += partition->metaCache->readAheadHits;
+		}
+	}
+	if (wasted) {
+		*wasted = partition->cache->readAheadWasted;
+		if (partition->metaCache != partition->cache) {
+			*wasted += partition->metaCache->readAheadWasted;
+		}
+	}
+	_FAT_unlock(&partition->lock);
+
+	return true;
+}
+
+bool fatGetCacheStats (const char* name, FAT_CACHE_STATS* stats) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+	CACHE_STATS total;
+
+	if (!partition || !stats) {
+		return false;
+	}
+
+	_FAT_lock(&partition->lock);
+	_FAT_getCacheStats (partition, &total);
+	// Always collected, outside the CACHE_STATS block
+	stats->flushCallsSaved = partition->cache->flushCallsSaved;
+	stats->readAheadHits = partition->cache->readAheadHits;
+	stats->readAheadWasted = partition->cache->readAheadWasted;
+	if (partition->metaCache != partition->cache) {
+		stats->flushCallsSaved += partition->metaCache->flushCallsSaved;
+		stats->readAheadHits += partition->metaCache->readAheadHits;
+		stats->readAheadWasted += partition->metaCache->readAheadWasted;
+	}
+	_FAT_unlock(&partition->lock);
+
+	// Copied field by field, so the public struct is free to differ from the internal one
+	stats->hits = total.hits;
+	stats->misses = total.misses;
+	stats->evictions = total.evictions;
+	stats->dirtyWritebacks = total.dirtyWritebacks;
+	stats->sectorsRead = total.sectorsRead;
+	stats->sectorsWritten = total.sectorsWritten;
+	stats->partialReads = total.partialReads;
+	stats->partialWrites = total.partialWrites;
+	stats->fullSectorReads = total.fullSectorReads;
+	stats->fullSectorWrites = total.fullSectorWrites;
+	stats->bytesCopied = total.bytesCopied;
+	stats->backgroundWritebacks = total.backgroundWritebacks;
+	stats->queuedTransfers = total.queuedTransfers;
+	stats->mappedSectors = total.mappedSectors;
+
+	return true;
+}
+
+bool fatResetCacheStats (const char* name) {
+	PARTITION* partition = _FAT_getMountedPartition (name);
+
+	if (!partition) {
+		return false;
+	}
+
+	_FAT_lock(&partition->lock);
+	_FAT_cache_resetStats (partition->cache);
+	if (partition->metaCache != partition->cache) {
+		_FAT_cache_resetStats (partition->metaCache);
+	}
+	_FAT_unlock(&partition->lock);
+
+	return true;
+}
@@ -1,6 +1,6 @@
 #include "common.h"
 
-#ifndef USE_LWP_LOCK
+#if !defined(USE_LWP_LOCK) && !defined(USE_PTHREAD_LOCK)
 
 #ifndef mutex_t
 typedef int mutex_t;
@@ -28,4 +28,4 @@ void __attribute__ ((weak)) _FAT_unlock(mutex_t *mutex)
 	return;
 }
 
-#endif // USE_LWP_LOCK
+#endif // !USE_LWP_LOCK && !USE_PTHREAD_LOCK
@@ -53,6 +53,32 @@ static inline void _FAT_unlock(mutex_t *mutex)
 	LWP_MutexUnlock(*mutex);
 }
 
+#elif defined(USE_PTHREAD_LOCK)
+
+#include <pthread.h>
+
+typedef pthread_mutex_t mutex_t;
+
+static inline void _FAT_lock_init(mutex_t *mutex)
+{
+	pthread_mutex_init(mutex, NULL);
+}
+
+static inline void _FAT_lock_deinit(mutex_t *mutex)
+{
+	pthread_mutex_destroy(mutex);
+}
+
+static inline void _FAT_lock(mutex_t *mutex)
+{
+	pthread_mutex_lock(mutex);
+}
+
+static inline void _FAT_unlock(mutex_t *mutex)
+{
+	pthread_mutex_unlock(mutex);
+}
+
 #else
 
 // We still need a blank lock type
@@ -65,7 +91,7 @@ void _FAT_lock_deinit(mutex_t *mutex);
 void _FAT_lock(mutex_t *mutex);
 void _FAT_unlock(mutex_t *mutex);
 
-#endif // USE_LWP_LOCK
+#endif // USE_LWP_LOCK / USE_PTHREAD_LOCK
 
 
 #endif // _LOCK_H
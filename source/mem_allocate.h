@@ -31,10 +31,18 @@
 #ifndef _MEM_ALLOCATE_H
 #define _MEM_ALLOCATE_H
 
+#include "common.h"
+
 ////#include <malloc.h>
 void*	malloc(size_t size);
 void	free(void* mem);
 
+#ifdef USE_HUGEPAGE_ARENA
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 static inline void* _FAT_mem_allocate (size_t size) {
 	return malloc (size);
 }
@@ -51,4 +59,64 @@ static inline void _FAT_mem_free (void* mem) {
 	free (mem);
 }
 
+#ifdef USE_HUGEPAGE_ARENA
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+/*
+Round size up to whole system pages, since mappings are made and trimmed in pages
+*/
+static inline size_t _FAT_mem_arenaSize (size_t size) {
+	size_t pageSize = (size_t) sysconf (_SC_PAGESIZE);
+
+	return (size + pageSize - 1) & ~(pageSize - 1);
+}
+
+/*
+Allocate a large block, such as the buffers of every cache page.
+Blocks are always page aligned, so O_DIRECT can transfer straight into them.
+Blocks of at least a hugepage are mapped on a hugepage boundary and
+marked for transparent hugepages, so they need very few TLB entries.
+*/
+static inline void* _FAT_mem_allocateArena (size_t size) {
+	uint8_t* mem;
+	size_t head, tail;
+
+	size = _FAT_mem_arenaSize (size);
+	if (size < HUGEPAGE_SIZE) {
+		mem = (uint8_t*) mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return (mem == MAP_FAILED) ? NULL : mem;
+	}
+
+	// Map an extra hugepage so the block can be trimmed to an aligned one
+	mem = (uint8_t*) mmap (NULL, size + HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+	head = (HUGEPAGE_SIZE - ((uintptr_t)mem & (HUGEPAGE_SIZE - 1))) & (HUGEPAGE_SIZE - 1);
+	tail = HUGEPAGE_SIZE - head;
+	if ((head && (munmap (mem, head) != 0)) ||
+		(tail && (munmap (mem + head + size, tail) != 0)))
+	{
+		munmap (mem, size + HUGEPAGE_SIZE);
+		return NULL;
+	}
+#ifdef MADV_HUGEPAGE
+	madvise (mem + head, size, MADV_HUGEPAGE);
+#endif
+	return mem + head;
+}
+
+static inline void _FAT_mem_freeArena (void* mem, size_t size) {
+	munmap (mem, _FAT_mem_arenaSize (size));
+}
+#else
+static inline void* _FAT_mem_allocateArena (size_t size) {
+	return _FAT_mem_align (size);
+}
+
+static inline void _FAT_mem_freeArena (void* mem, size_t size) {
+	_FAT_mem_free (mem);
+}
+#endif
+
 #endif // _MEM_ALLOCATE_H
@@ -36,6 +36,9 @@
 
 #include <string.h>
 #include <ctype.h>
+#ifdef USE_WRITEBACK_THREAD
+#include <time.h>
+#endif
 ////#include <sys/iosupport.h>
 
 /*
@@ -179,7 +182,8 @@ sec_t FindFirstValidPartition(const DISC_INTERFACE* disc)
 }
 
 
-PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t sectorsPerPage, sec_t startSector, uint8_t *sectorBuffer)
+PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t sectorsPerPage,
+	uint32_t metaCacheSize, uint32_t metaSectorsPerPage, bool freeClusterMap, sec_t startSector, uint8_t *sectorBuffer)
 {
 	PARTITION* partition;
 
@@ -242,7 +246,9 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	}
 
 	partition->bytesPerSector = u8array_to_u16(sectorBuffer, BPB_bytesPerSector);
-	if(partition->bytesPerSector < MIN_SECTOR_SIZE || partition->bytesPerSector > MAX_SECTOR_SIZE) {
+	if(partition->bytesPerSector < MIN_SECTOR_SIZE || partition->bytesPerSector > MAX_SECTOR_SIZE ||
+		(partition->bytesPerSector & (partition->bytesPerSector - 1)))
+	{
 		// Unsupported sector size
 		_FAT_mem_free(partition);
 		return NULL;
@@ -267,6 +273,13 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	partition->fat.firstFree = CLUSTER_FIRST;
 	partition->fat.numberFreeCluster = 0;
 	partition->fat.numberLastAllocCluster = 0;
+	partition->fat.freeMap = NULL;
+	partition->fat.freeMapBytes = 0;
+	partition->fat.freeMapEnabled = freeClusterMap;
+	partition->fat.mirrorCount = (sectorBuffer[BPB_numFATs] > 1) ? sectorBuffer[BPB_numFATs] - 1 : 0;
+	partition->fat.mirrorDirty = NULL;
+	partition->fat.mirrorDirtyFirst = 1;
+	partition->fat.mirrorDirtyLast = 0;
 
 	if (clusterCount < CLUSTERS_PER_FAT12) {
 		partition->filesysType = FS_FAT12;	// FAT12 volume
@@ -275,43 +288,88 @@ PARTITION* _FAT_partition_constructor_buf (const DISC_INTERFACE* disc, uint32_t
 	} else {
 		partition->filesysType = FS_FAT32;	// FAT32 volume
 	}
+	_FAT_fat_setAccessors (partition);
 
 	if (partition->filesysType != FS_FAT32) {
 		partition->rootDirCluster = FAT16_ROOT_DIR_CLUSTER;
 	} else {
 		// Set up for the FAT32 way
 		partition->rootDirCluster = u8array_to_u32(sectorBuffer, BPB_FAT32_rootClus);
-		// Check if FAT mirroring is enabled
-		if (!(sectorBuffer[BPB_FAT32_extFlags] & 0x80)) {
-			// Use the active FAT
+		// Bit 7 of extFlags turns mirroring off, leaving only the FAT numbered in bits 0-3 in use
+		if (sectorBuffer[BPB_FAT32_extFlags] & 0x80) {
+			// Use the active FAT, and leave the others alone
 			partition->fat.fatStart = partition->fat.fatStart + ( partition->fat.sectorsPerFat * (sectorBuffer[BPB_FAT32_extFlags] & 0x0F));
+			partition->fat.mirrorCount = 0;
 		}
 	}
 
 	// Create a cache to use
-	partition->cache = _FAT_cache_constructor (cacheSize, sectorsPerPage, partition->disc, startSector+partition->numberOfSectors, partition->bytesPerSector);
+	partition->cache = _FAT_cache_constructor (cacheSize, sectorsPerPage, partition->disc, startSector+partition->numberOfSectors, partition->bytesPerSector, DEFAULT_CACHE_POLICY);
+	if (partition->cache == NULL) {
+		_FAT_lock_deinit(&partition->lock);
+		_FAT_mem_free (partition);
+		return NULL;
+	}
+
+	// Give FAT and directory sectors a pool of their own, so streaming file data can't evict them.
+	// If there isn't enough memory for it, they share the data cache as before.
+	partition->metaCache = NULL;
+	if (metaCacheSize > 0) {
+		partition->metaCache = _FAT_cache_constructor (metaCacheSize, metaSectorsPerPage, partition->disc, startSector+partition->numberOfSectors, partition->bytesPerSector, DEFAULT_META_CACHE_POLICY);
+	}
+	if (partition->metaCache == NULL) {
+		partition->metaCache = partition->cache;
+	}
 
 	// Set current directory to the root
 	partition->cwdCluster = partition->rootDirCluster;
 
+	// No directory is being scanned yet
+	partition->dirReadAhead.nextPosition = 0;
+	partition->dirReadAhead.window = 0;
+
 	// Check if this disc is writable, and set the readOnly property appropriately
 	partition->readOnly = !(_FAT_disc_features(disc) & FEATURE_MEDIUM_CANWRITE);
 
+	// Track which FAT sectors change, so only those are copied to the mirror FATs.
+	// Without the memory for it, the whole range between the first and last change is copied.
+	if (!partition->readOnly && (partition->fat.mirrorCount > 0)) {
+		partition->fat.mirrorDirty = (uint32_t*) _FAT_mem_allocate (((partition->fat.sectorsPerFat + 31) / 32) * sizeof(uint32_t));
+		if (partition->fat.mirrorDirty != NULL) {
+			memset (partition->fat.mirrorDirty, 0, ((partition->fat.sectorsPerFat + 31) / 32) * sizeof(uint32_t));
+		}
+	}
+
 	// There are currently no open files on this partition
 	partition->openFileCount = 0;
 	partition->firstOpenFile = NULL;
 
 	_FAT_partition_readFSinfo(partition);
 
+#ifdef USE_WRITEBACK_THREAD
+	// The thread is only started on request
+	{
+		pthread_condattr_t attr;
+		pthread_condattr_init (&attr);
+		pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+		pthread_cond_init (&partition->writebackWake, &attr);
+		pthread_condattr_destroy (&attr);
+	}
+	partition->writebackRunning = false;
+	partition->writebackMaxAge = 0;
+	partition->writebackDirtyRatio = 0;
+#endif
+
 	return partition;
 }
 
-PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t sectorsPerPage, sec_t startSector)
+PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t sectorsPerPage,
+	uint32_t metaCacheSize, uint32_t metaSectorsPerPage, bool freeClusterMap, sec_t startSector)
 {
 	uint8_t *sectorBuffer = (uint8_t*) _FAT_mem_align(MAX_SECTOR_SIZE);
 	if (!sectorBuffer) return NULL;
 	PARTITION *ret = _FAT_partition_constructor_buf(disc, cacheSize,
-			sectorsPerPage, startSector, sectorBuffer);
+			sectorsPerPage, metaCacheSize, metaSectorsPerPage, freeClusterMap, startSector, sectorBuffer);
 	_FAT_mem_free(sectorBuffer);
 	return ret;
 }
@@ -320,20 +378,34 @@ PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cach
 void _FAT_partition_destructor (PARTITION* partition) {
 	FILE_STRUCT* nextFile;
 
+#ifdef USE_WRITEBACK_THREAD
+	_FAT_partition_setWriteback (partition, 0, 0);
+	pthread_cond_destroy (&partition->writebackWake);
+#endif
+
 	_FAT_lock(&partition->lock);
 
 	// Synchronize open files
 	nextFile = partition->firstOpenFile;
 	while (nextFile) {
+		_FAT_file_releasePreallocation (nextFile);
 		_FAT_syncToDisc (nextFile);
+		_FAT_file_freeExtents (nextFile);
 		nextFile = nextFile->nextOpenFile;
 	}
 
 	// Write out the fs info sector
 	_FAT_partition_writeFSinfo(partition);
 
-	// Free memory used by the cache, writing it to disc at the same time
+	// Write out the caches and bring the mirror FATs up to date, then free the caches
+	_FAT_partition_flushCaches (partition);
 	_FAT_cache_destructor (partition->cache);
+	if (partition->metaCache != partition->cache) {
+		_FAT_cache_destructor (partition->metaCache);
+	}
+
+	_FAT_fat_setFreeMap (partition, false);
+	_FAT_mem_free (partition->fat.mirrorDirty);
 
 	// Unlock the partition and destroy the lock
 	_FAT_unlock(&partition->lock);
@@ -343,6 +415,113 @@ void _FAT_partition_destructor (PARTITION* partition) {
 	_FAT_mem_free (partition);
 }
 
+bool _FAT_partition_flushCaches (PARTITION* partition) {
+	// File data goes first, so the FAT never points at unwritten clusters
+	if (!_FAT_cache_flush (partition->cache)) {
+		return false;
+	}
+	if ((partition->metaCache != partition->cache) && !_FAT_cache_flush (partition->metaCache)) {
+		return false;
+	}
+	// Then the mirror FATs, once the active one is on disc
+	return _FAT_fat_syncMirrors (partition);
+}
+
+#ifdef USE_WRITEBACK_THREAD
+/*
+One pass of background writeback. Called with the partition lock held.
+*/
+static bool _FAT_partition_writebackAged (PARTITION* partition) {
+	uint32_t maxAge = partition->writebackMaxAge;
+	unsigned int dirtyRatio = partition->writebackDirtyRatio;
+
+	// As in _FAT_partition_flushCaches, all file data goes out before any FAT sector
+	if ((partition->metaCache != partition->cache) &&
+		_FAT_cache_writebackDue (partition->metaCache, maxAge, dirtyRatio))
+	{
+		if (!_FAT_cache_flush (partition->cache)) {
+			return false;
+		}
+		return _FAT_cache_writebackAged (partition->metaCache, maxAge, dirtyRatio);
+	}
+
+	return _FAT_cache_writebackAged (partition->cache, maxAge, dirtyRatio);
+}
+
+static void* _FAT_partition_writebackThread (void* arg) {
+	PARTITION* partition = (PARTITION*)arg;
+	struct timespec wake;
+	uint32_t interval;
+
+	_FAT_lock(&partition->lock);
+	while (partition->writebackRunning) {
+		_FAT_partition_writebackAged (partition);
+
+		// Check a few times per age limit, so no page stays dirty much longer than asked
+		interval = partition->writebackMaxAge / 4;
+		if (interval == 0) {
+			interval = 100;
+		} else if (interval < 10) {
+			interval = 10;
+		} else if (interval > 1000) {
+			interval = 1000;
+		}
+		clock_gettime (CLOCK_MONOTONIC, &wake);
+		wake.tv_sec += interval / 1000;
+		wake.tv_nsec += (interval % 1000) * 1000000;
+		if (wake.tv_nsec >= 1000000000) {
+			wake.tv_sec++;
+			wake.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait (&partition->writebackWake, &partition->lock, &wake);
+	}
+	_FAT_unlock(&partition->lock);
+
+	return NULL;
+}
+
+bool _FAT_partition_setWriteback (PARTITION* partition, uint32_t maxAgeMs, unsigned int dirtyRatio) {
+	pthread_t thread;
+	bool ret = true;
+
+	_FAT_lock(&partition->lock);
+
+	if (partition->readOnly) {
+		maxAgeMs = 0;
+		dirtyRatio = 0;
+	}
+	partition->writebackMaxAge = maxAgeMs;
+	partition->writebackDirtyRatio = dirtyRatio;
+
+	if ((maxAgeMs == 0) && (dirtyRatio == 0)) {
+		if (!partition->writebackRunning) {
+			_FAT_unlock(&partition->lock);
+			return true;
+		}
+		// Stop the thread and wait for it outside the lock, which it needs to finish
+		thread = partition->writebackThread;
+		partition->writebackRunning = false;
+		pthread_cond_signal (&partition->writebackWake);
+		_FAT_unlock(&partition->lock);
+		pthread_join (thread, NULL);
+		return true;
+	}
+
+	if (partition->writebackRunning) {
+		pthread_cond_signal (&partition->writebackWake);
+	} else {
+		partition->writebackRunning = true;
+		if (pthread_create (&partition->writebackThread, NULL, _FAT_partition_writebackThread, partition) != 0) {
+			partition->writebackRunning = false;
+			ret = false;
+		}
+	}
+
+	_FAT_unlock(&partition->lock);
+	return ret;
+}
+#endif
+
 //typedef long off32_t;
 //typedef off32_t off_t;
 
@@ -40,6 +40,8 @@
 // Filesystem type
 typedef enum {FS_UNKNOWN, FS_FAT12, FS_FAT16, FS_FAT32} FS_TYPE;
 
+struct _PARTITION;
+
 typedef struct {
 	sec_t    fatStart;
 	uint32_t sectorsPerFat;
@@ -47,11 +49,26 @@ typedef struct {
 	uint32_t firstFree;
 	uint32_t numberFreeCluster;
 	uint32_t numberLastAllocCluster;
+	uint32_t* freeMap;				// One bit per cluster, set if it is free. NULL until first needed
+	uint32_t freeMapBytes;			// Memory held by freeMap
+	bool     freeMapEnabled;		// If clear, free clusters are found by reading the FAT
+	uint8_t  mirrorCount;			// FAT copies after the active one that mirror it. 0 if mirroring is off
+	uint32_t* mirrorDirty;			// One bit per FAT sector changed since the mirrors were last written
+	uint32_t mirrorDirtyFirst;		// Range of changed FAT sectors, empty if first > last.
+	uint32_t mirrorDirtyLast;		// If mirrorDirty is NULL, every sector in it is copied
+	// Entry accessors for the FAT type, chosen when the partition is mounted
+	uint32_t (*nextCluster) (struct _PARTITION* partition, uint32_t cluster);
+	bool     (*writeEntry) (struct _PARTITION* partition, uint32_t cluster, uint32_t value);
+	unsigned int sectorShift;		// log2 of bytesPerSector
+	const uint8_t* pinData;			// The FAT sector last read, borrowed from metaCache. NULL if none
+	sec_t    pinSector;				// Sector pinData points at
+	uint32_t pinGeneration;			// metaCache generation pinData was borrowed in
 } FAT;
 
-typedef struct {
+typedef struct _PARTITION {
 	const DISC_INTERFACE* disc;
-	CACHE*                cache;
+	CACHE*                cache;				// File data
+	CACHE*                metaCache;			// FAT and directory sectors. Same as cache if there is no separate pool
 	// Info about the partition
 	FS_TYPE               filesysType;
 	uint64_t              totalSize;
@@ -68,15 +85,26 @@ typedef struct {
 	uint32_t              cwdCluster;			// Current working directory cluster
 	int                   openFileCount;
 	struct _FILE_STRUCT*  firstOpenFile;		// The start of a linked list of files
+	CACHE_READAHEAD       dirReadAhead;			// Sequential read detection for directory scans, in sectors
 	mutex_t               lock;					// A lock for partition operations
+#ifdef USE_WRITEBACK_THREAD
+	pthread_t             writebackThread;		// Writes back aged dirty cache pages while writebackRunning is set
+	pthread_cond_t        writebackWake;		// Signalled to make the writeback thread re-read its settings
+	bool                  writebackRunning;
+	uint32_t              writebackMaxAge;		// Milliseconds a page may stay dirty, 0 for no limit
+	unsigned int          writebackDirtyRatio;	// Percentage of dirty pages that triggers writeback, 0 for no limit
+#endif
 	bool                  readOnly;				// If this is set, then do not try writing to the disc
 	char                  label[12];			// Volume label
 } PARTITION;
 
 /*
-Mount the supplied device and return a pointer to the struct necessary to use it
+Mount the supplied device and return a pointer to the struct necessary to use it.
+If metaCacheSize is 0, FAT and directory sectors share the file data cache.
+If freeClusterMap is false, the free cluster map is never built, even while mounting.
 */
-PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t SectorsPerPage, sec_t startSector);
+PARTITION* _FAT_partition_constructor (const DISC_INTERFACE* disc, uint32_t cacheSize, uint32_t SectorsPerPage,
+	uint32_t metaCacheSize, uint32_t metaSectorsPerPage, bool freeClusterMap, sec_t startSector);
 
 /*
 Dismount the device and free all structures used.
@@ -84,6 +112,19 @@ Will also attempt to synchronise all open files to disc.
 */
 void _FAT_partition_destructor (PARTITION* partition);
 
+/*
+Write the dirty sectors of both cache pools to disc, file data first.
+*/
+bool _FAT_partition_flushCaches (PARTITION* partition);
+
+#ifdef USE_WRITEBACK_THREAD
+/*
+Start, reconfigure or, with both limits 0, stop the background writeback thread of a partition.
+Must be called without the partition lock held.
+*/
+bool _FAT_partition_setWriteback (PARTITION* partition, uint32_t maxAgeMs, unsigned int dirtyRatio);
+#endif
+
 /*
 Return the partition specified in a path, as taken from the devoptab.
 */
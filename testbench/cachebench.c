@@ -0,0 +1,247 @@
+// cachebench.c - micro benchmarks for the libfat sector cache
+// Runs the cache against a RAM disc so only the cache's own CPU cost is measured.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../source/common.h"
+#include "../source/cache.h"
+#include "flashsim.h"
+
+#define BENCH_BYTES_PER_SECTOR	512
+#define BENCH_DISC_SECTORS		(64 * 1024)
+
+static uint8_t* benchDisc;
+static volatile uint32_t benchSink;	// keeps the timed reads from being optimised away
+static uint32_t benchDiscReads;		// reads issued to the RAM disc, i.e. cache misses
+
+static bool benchStartup(void) { return true; }
+static bool benchIsInserted(void) { return true; }
+static bool benchClearStatus(void) { return true; }
+static bool benchShutdown(void) { return true; }
+
+static bool benchReadSectors(sec_t sector, sec_t numSectors, void* buffer)
+{
+	benchDiscReads++;
+	memcpy(buffer, benchDisc + sector * BENCH_BYTES_PER_SECTOR, numSectors * BENCH_BYTES_PER_SECTOR);
+	return true;
+}
+
+static bool benchWriteSectors(sec_t sector, sec_t numSectors, const void* buffer)
+{
+	memcpy(benchDisc + sector * BENCH_BYTES_PER_SECTOR, buffer, numSectors * BENCH_BYTES_PER_SECTOR);
+	return true;
+}
+
+static const DISC_INTERFACE benchInterface = {
+	0x48434e42, // ioType "BNCH"
+	FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE,
+	benchStartup,
+	benchIsInserted,
+	benchReadSectors,
+	benchWriteSectors,
+	benchClearStatus,
+	benchShutdown
+};
+
+static double benchSeconds(void)
+{
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/*
+Measure cache hit lookups per second as the number of pages grows.
+Every page is loaded first, then 4 byte reads are spread over all of
+them the way _FAT_fat_nextCluster touches the FAT.
+*/
+static void benchCacheLookup(void)
+{
+	static const unsigned int pageCounts[] = { 4, 16, 64, 256, 1024, 4096 };
+	const unsigned int sectorsPerPage = 8;
+	const unsigned int lookups = 4 * 1024 * 1024;
+	unsigned int p, i;
+
+	printf("cache lookup: pages  lookups/s\n");
+
+	for (p = 0; p < sizeof(pageCounts) / sizeof(pageCounts[0]); p++) {
+		unsigned int numberOfPages = pageCounts[p];
+		unsigned int cachedSectors = numberOfPages * sectorsPerPage;
+		CACHE* cache = _FAT_cache_constructor(numberOfPages, sectorsPerPage, &benchInterface, BENCH_DISC_SECTORS, BENCH_BYTES_PER_SECTOR, CACHE_POLICY_LRU);
+		uint32_t value;
+		double start, elapsed;
+
+		if (cache == NULL) {
+			printf("  %5u  (out of memory)\n", numberOfPages);
+			continue;
+		}
+
+		for (i = 0; i < cachedSectors; i += sectorsPerPage) {
+			_FAT_cache_readLittleEndianValue(cache, &value, i, 0, 4);
+		}
+
+		start = benchSeconds();
+		for (i = 0; i < lookups; i++) {
+			sec_t sector = (i * 2654435761u) % cachedSectors;
+			_FAT_cache_readLittleEndianValue(cache, &value, sector, (i & 127) << 2, 4);
+			benchSink += value;
+		}
+		elapsed = benchSeconds() - start;
+
+		printf("  %5u  %10.0f\n", numberOfPages, elapsed > 0 ? lookups / elapsed : 0.0);
+
+		_FAT_cache_destructor(cache);
+	}
+}
+
+/*
+Compare replacement policies on a streaming read mixed with small file
+opens. The stream reads a large file a sector at a time while every few
+pages a small file is opened, which touches a few of a fixed set of FAT
+and directory sectors plus one sector of the file itself. The stream and
+the small files cost one miss per page whatever the policy, so the
+difference between the two is the FAT and directory misses.
+*/
+static void benchScanResistance(void)
+{
+	static const CACHE_POLICY policies[] = { CACHE_POLICY_LRU, CACHE_POLICY_2Q };
+	static const char* const policyNames[] = { "LRU", "2Q" };
+	const unsigned int numberOfPages = 16;
+	const unsigned int sectorsPerPage = 8;
+	const sec_t metaSectors = 64;				// FAT and directory sectors, 8 pages
+	const sec_t streamStart = 1024;
+	const sec_t streamSectors = 32 * 1024;
+	const sec_t smallFilesStart = streamStart + streamSectors;
+	const unsigned int pagesPerOpen = 4;
+	const unsigned int metaReadsPerOpen = 4;
+	unsigned int p, j;
+
+	printf("scan resistance: policy  accesses  misses  hit rate\n");
+
+	for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+		CACHE* cache = _FAT_cache_constructor(numberOfPages, sectorsPerPage, &benchInterface, BENCH_DISC_SECTORS, BENCH_BYTES_PER_SECTOR, policies[p]);
+		uint32_t value;
+		uint32_t accesses = 0;
+		unsigned int seed = 1;
+		sec_t sector;
+
+		if (cache == NULL) {
+			printf("  %-6s  (out of memory)\n", policyNames[p]);
+			continue;
+		}
+		_FAT_cache_setReadAhead(cache, 0, 0);
+		benchDiscReads = 0;
+
+		for (sector = 0; sector < streamSectors; sector++) {
+			_FAT_cache_readLittleEndianValue(cache, &value, streamStart + sector, 0, 4);
+			accesses++;
+
+			if ((sector % (sectorsPerPage * pagesPerOpen)) != 0) {
+				continue;
+			}
+			for (j = 0; j < metaReadsPerOpen; j++) {
+				seed = seed * 1103515245 + 12345;
+				_FAT_cache_readLittleEndianValue(cache, &value, (seed >> 8) % metaSectors, 0, 4);
+				accesses++;
+			}
+			seed = seed * 1103515245 + 12345;
+			_FAT_cache_readLittleEndianValue(cache, &value, smallFilesStart + (seed >> 8) % (BENCH_DISC_SECTORS - smallFilesStart), 0, 4);
+			accesses++;
+		}
+
+		printf("  %-6s  %8u  %6u  %7.1f%%\n", policyNames[p], accesses, benchDiscReads,
+			100.0 * (accesses - benchDiscReads) / accesses);
+
+		_FAT_cache_destructor(cache);
+	}
+}
+
+/*
+Compare flush modes and replacement policies on simulated flash. Small
+writes are scattered over a few files the way appends and directory
+updates land, then the cache is flushed every so often. The simulated
+card time and the read-modify-writes it needed show what the write
+pattern costs the media, which a RAM disc can't.
+*/
+static void benchFlashWrites(void)
+{
+	static const CACHE_FLUSH_MODE modes[] = { CACHE_FLUSH_PAGES, CACHE_FLUSH_COALESCED };
+	static const char* const modeNames[] = { "pages", "coalesced" };
+	static const CACHE_POLICY policies[] = { CACHE_POLICY_LRU, CACHE_POLICY_2Q };
+	static const char* const policyNames[] = { "LRU", "2Q" };
+	const unsigned int numberOfPages = 32;
+	const unsigned int sectorsPerPage = 8;
+	const unsigned int files = 4;
+	const sec_t fileSectors = 4096;
+	const unsigned int writes = 16 * 1024;
+	const unsigned int writesPerFlush = 256;
+	FLASHSIM_CONFIG config;
+	FLASHSIM_STATS stats;
+	const DISC_INTERFACE* disc;
+	uint8_t buffer[BENCH_BYTES_PER_SECTOR];
+	unsigned int m, p, i;
+
+	flashSimDefaultConfig(&config, BENCH_DISC_SECTORS);
+	disc = flashSimCreate(&config);
+	if (disc == NULL) {
+		printf("flash writes: out of memory\n");
+		return;
+	}
+	memset(buffer, 0xa5, sizeof(buffer));
+
+	printf("flash writes: flush      policy  writes  erases  rmw    card ms\n");
+
+	for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+			CACHE* cache = _FAT_cache_constructor(numberOfPages, sectorsPerPage, disc, BENCH_DISC_SECTORS, BENCH_BYTES_PER_SECTOR, policies[p]);
+			sec_t next[4] = { 0, 0, 0, 0 };
+			unsigned int seed = 1;
+
+			if (cache == NULL) {
+				printf("  %-9s  %-6s  (out of memory)\n", modeNames[m], policyNames[p]);
+				continue;
+			}
+			_FAT_cache_setFlushMode(cache, modes[m], 0);
+			flashSimResetStats();
+
+			for (i = 0; i < writes; i++) {
+				unsigned int file;
+
+				seed = seed * 1103515245 + 12345;
+				file = (seed >> 8) % files;
+				// The FAT and directory entry of the file, then the next sector of its data
+				_FAT_cache_writePartialSector(cache, buffer, 32 + file, 0, 32);
+				_FAT_cache_writeSector(cache, buffer, 8192 + file * fileSectors + next[file]);
+				next[file] = (next[file] + 1) % fileSectors;
+
+				if ((i % writesPerFlush) == writesPerFlush - 1) {
+					_FAT_cache_flush(cache);
+				}
+			}
+			_FAT_cache_destructor(cache);
+
+			flashSimGetStats(&stats);
+			printf("  %-9s  %-6s  %6u  %6u  %5u  %9.1f\n", modeNames[m], policyNames[p],
+				stats.writes, stats.erases, stats.readModifyWrites, (stats.readNs + stats.writeNs) / 1e6);
+		}
+	}
+
+	flashSimDestroy();
+}
+
+void cacheBench(void)
+{
+	benchDisc = (uint8_t*)calloc(BENCH_DISC_SECTORS, BENCH_BYTES_PER_SECTOR);
+	if (benchDisc == NULL) {
+		printf("cache bench: out of memory\n");
+		return;
+	}
+
+	benchCacheLookup();
+	benchScanResistance();
+	benchFlashWrites();
+
+	free(benchDisc);
+	benchDisc = NULL;
+}
@@ -0,0 +1,171 @@
+// flashsim.c - a RAM disc that models the timing of SD and other flash media
+//
+// Writes are modelled on how SD cards manage erase blocks. The card keeps one
+// block open for writing. A write that starts a block, or carries on exactly
+// where the last write to the open block stopped, is programmed directly, with
+// an erase whenever a fresh block is started. Any other write lands in the
+// middle of a block that already holds data, so the card erases a new block
+// and copies the untouched sectors across: a read-modify-write.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "flashsim.h"
+
+static struct {
+	FLASHSIM_CONFIG config;
+	FLASHSIM_STATS  stats;
+	uint8_t*        data;
+	sec_t           openBlock;		// Erase block being appended to, or FLASHSIM_NO_BLOCK
+	sec_t           openNext;		// Next sector of the open block a write can append at
+} flashSim;
+
+#define FLASHSIM_NO_BLOCK	((sec_t)-1)
+
+static bool flashSimStartup (void) { return flashSim.data != NULL; }
+static bool flashSimIsInserted (void) { return flashSim.data != NULL; }
+static bool flashSimClearStatus (void) { return true; }
+static bool flashSimShutdown (void) { return true; }
+
+static bool flashSimInRange (sec_t sector, sec_t numSectors)
+{
+	return (flashSim.data != NULL) && (numSectors > 0) &&
+		(sector < flashSim.config.sectors) && (numSectors <= flashSim.config.sectors - sector);
+}
+
+static bool flashSimReadSectors (sec_t sector, sec_t numSectors, void* buffer)
+{
+	if (!flashSimInRange(sector, numSectors)) {
+		return false;
+	}
+
+	memcpy(buffer, flashSim.data + (size_t)sector * FLASHSIM_BYTES_PER_SECTOR, (size_t)numSectors * FLASHSIM_BYTES_PER_SECTOR);
+
+	flashSim.stats.reads++;
+	flashSim.stats.sectorsRead += numSectors;
+	flashSim.stats.readNs += flashSim.config.commandNs + (uint64_t)numSectors * flashSim.config.readSectorNs;
+	return true;
+}
+
+/*
+Cost of writing count sectors at sector, all inside one erase block
+*/
+static uint64_t flashSimBlockWrite (sec_t sector, sec_t count)
+{
+	const FLASHSIM_CONFIG* config = &flashSim.config;
+	sec_t block = sector / config->eraseBlockSectors;
+	sec_t offset = sector % config->eraseBlockSectors;
+	uint64_t ns = (uint64_t)count * config->writeSectorNs;
+
+	if (offset == 0) {
+		// Starting a block, so the card erases a fresh one
+		flashSim.stats.erases++;
+		ns += config->eraseNs;
+	} else if ((block != flashSim.openBlock) || (sector != flashSim.openNext)) {
+		// Rewriting part of a block: copy the rest of it into a fresh one
+		sec_t copied = config->eraseBlockSectors - count;
+
+		flashSim.stats.erases++;
+		flashSim.stats.readModifyWrites++;
+		flashSim.stats.rmwSectorsCopied += copied;
+		ns += config->eraseNs + (uint64_t)copied * (config->readSectorNs + config->writeSectorNs);
+	}
+
+	flashSim.openBlock = block;
+	flashSim.openNext = sector + count;
+	if (offset + count == config->eraseBlockSectors) {
+		// The block is full, so it is closed
+		flashSim.openBlock = FLASHSIM_NO_BLOCK;
+	}
+	return ns;
+}
+
+static bool flashSimWriteSectors (sec_t sector, sec_t numSectors, const void* buffer)
+{
+	const FLASHSIM_CONFIG* config = &flashSim.config;
+	uint64_t ns = config->commandNs;
+	sec_t count;
+
+	if (!flashSimInRange(sector, numSectors)) {
+		return false;
+	}
+
+	memcpy(flashSim.data + (size_t)sector * FLASHSIM_BYTES_PER_SECTOR, buffer, (size_t)numSectors * FLASHSIM_BYTES_PER_SECTOR);
+
+	flashSim.stats.writes++;
+	flashSim.stats.sectorsWritten += numSectors;
+
+	if (config->eraseBlockSectors == 0) {
+		flashSim.stats.writeNs += ns + (uint64_t)numSectors * config->writeSectorNs;
+		return true;
+	}
+
+	while (numSectors > 0) {
+		count = config->eraseBlockSectors - (sector % config->eraseBlockSectors);
+		if (count > numSectors) {
+			count = numSectors;
+		}
+		ns += flashSimBlockWrite(sector, count);
+		sector += count;
+		numSectors -= count;
+	}
+	flashSim.stats.writeNs += ns;
+	return true;
+}
+
+static const DISC_INTERFACE flashSimInterface = {
+	0x4d495346, // ioType "FSIM"
+	FEATURE_MEDIUM_CANREAD | FEATURE_MEDIUM_CANWRITE,
+	flashSimStartup,
+	flashSimIsInserted,
+	flashSimReadSectors,
+	flashSimWriteSectors,
+	flashSimClearStatus,
+	flashSimShutdown
+};
+
+void flashSimDefaultConfig (FLASHSIM_CONFIG* config, sec_t sectors)
+{
+	config->sectors = sectors;
+	config->commandNs = 100000;				// 100us per command
+	config->readSectorNs = 25000;			// about 20MB/s
+	config->writeSectorNs = 50000;			// about 10MB/s
+	config->eraseBlockSectors = 8192;		// 4MB allocation unit
+	config->eraseNs = 2000000;				// 2ms
+}
+
+const DISC_INTERFACE* flashSimCreate (const FLASHSIM_CONFIG* config)
+{
+	flashSimDestroy();
+
+	flashSim.data = (uint8_t*)calloc(config->sectors, FLASHSIM_BYTES_PER_SECTOR);
+	if (flashSim.data == NULL) {
+		return NULL;
+	}
+	flashSim.config = *config;
+	flashSim.openBlock = FLASHSIM_NO_BLOCK;
+	flashSim.openNext = 0;
+	flashSimResetStats();
+	return &flashSimInterface;
+}
+
+void flashSimDestroy (void)
+{
+	free(flashSim.data);
+	flashSim.data = NULL;
+}
+
+uint8_t* flashSimData (void)
+{
+	return flashSim.data;
+}
+
+void flashSimGetStats (FLASHSIM_STATS* stats)
+{
+	*stats = flashSim.stats;
+}
+
+void flashSimResetStats (void)
+{
+	memset(&flashSim.stats, 0, sizeof(flashSim.stats));
+}
@@ -0,0 +1,54 @@
+// flashsim.h - a RAM disc that models the timing of SD and other flash media
+// Time is simulated, so runs are reproducible and take no longer than the copies.
+
+#ifndef _FLASHSIM_H
+#define _FLASHSIM_H
+
+#include "../source/common.h"
+
+#define FLASHSIM_BYTES_PER_SECTOR	512
+
+typedef struct {
+	sec_t    sectors;				// Size of the disc
+	uint32_t commandNs;				// Fixed cost of every read or write command
+	uint32_t readSectorNs;			// Transfer cost per sector read
+	uint32_t writeSectorNs;			// Transfer and program cost per sector written
+	sec_t    eraseBlockSectors;		// Sectors per erase block, 0 disables the erase model
+	uint32_t eraseNs;				// Cost of erasing one block
+} FLASHSIM_CONFIG;
+
+typedef struct {
+	uint32_t reads;					// Read commands
+	uint32_t writes;				// Write commands
+	uint64_t sectorsRead;
+	uint64_t sectorsWritten;
+	uint32_t erases;				// Erase blocks erased, including for read-modify-write
+	uint32_t readModifyWrites;		// Writes that forced an erase block to be copied
+	uint64_t rmwSectorsCopied;		// Sectors the card had to copy for those writes
+	uint64_t readNs;				// Simulated time spent in reads
+	uint64_t writeNs;				// Simulated time spent in writes, including erases
+} FLASHSIM_STATS;
+
+/*
+Fill in a configuration resembling a class 10 SD card
+*/
+void flashSimDefaultConfig (FLASHSIM_CONFIG* config, sec_t sectors);
+
+/*
+Create the simulated disc, zero filled. Only one exists at a time.
+Returns NULL if there isn't enough memory.
+*/
+const DISC_INTERFACE* flashSimCreate (const FLASHSIM_CONFIG* config);
+
+void flashSimDestroy (void);
+
+/*
+The disc's contents, for seeding it or checking what was written
+*/
+uint8_t* flashSimData (void);
+
+void flashSimGetStats (FLASHSIM_STATS* stats);
+
+void flashSimResetStats (void);
+
+#endif // _FLASHSIM_H
@@ -203,7 +203,14 @@ struct _FILE_STRUCT {
 
 typedef struct _FILE_STRUCT FILE_STRUCT;
 
+#ifdef CACHE_BENCH
+void cacheBench(void);
+#endif
+
 int main(void) {
+#ifdef CACHE_BENCH
+	cacheBench();
+#endif
 #if 0
     if (!fatInitDefault()) {
         printf("Fat init error !!!\n");